@@ -0,0 +1,182 @@
+#include <batch.h>
+#include <blk.h>
+#include <cpu.h>
+#include <errno.h>
+#include <events.h>
+#include <mmio.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BATCH_CHUNK 100000 /* steps between checks of the device flags */
+
+static uint8_t input[BATCH_INPUT_MAX];
+static uint32_t input_len;
+
+static bool marked;
+static bool done;
+static uint64_t done_value;
+
+static bool batch_read(struct core *, uintptr_t offset, void *buf,
+					   size_t len) {
+	memset(buf, 0, len);
+	if (offset == BATCH_REG_LEN && len == 8) {
+		uint64_t v = input_len;
+		memcpy(buf, &v, sizeof v);
+	} else if (offset >= BATCH_INPUT) {
+		const uintptr_t at = offset - BATCH_INPUT;
+		if (at < input_len)
+			memcpy(buf, input + at, len < input_len - at ? len : input_len - at);
+	}
+	return true;
+}
+
+/* the run loop notices at the next block boundary */
+static bool batch_write(struct core *c, uintptr_t offset, const void *buf,
+						size_t len) {
+	if (len != 8)
+		return true;
+	if (offset == BATCH_REG_MARK) {
+		marked = true;
+	} else if (offset == BATCH_REG_DONE) {
+		memcpy(&done_value, buf, sizeof done_value);
+		done = true;
+	} else {
+		return true;
+	}
+	cpu_request(c, CPU_REQ_PAUSE);
+	return true;
+}
+
+bool batch_init(void) {
+	static struct mmio_hook hook = {
+		.base = BATCH_BASE,
+		.size = BATCH_SIZE,
+		.read = batch_read,
+		.write = batch_write,
+		.next = nullptr,
+	};
+	return register_mmio_hook(&hook);
+}
+
+static bool read_full(int fd, void *buf, size_t len) {
+	uint8_t *p = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+/* runs until a device flag is set, HLT or the limit, false on HLT */
+static bool run_until(struct core *c, const bool *flag, uint64_t limit) {
+	const uint64_t start = c->retired;
+	while (!*flag && c->retired - start < limit) {
+		uint64_t left = limit - (c->retired - start);
+		enum cpu_exit why =
+			cpu_run(c, left < BATCH_CHUNK ? left : BATCH_CHUNK);
+		if (why == CPU_EXIT_HALT)
+			return false;
+		if (cpu_take_requests(c) & CPU_REQ_IRQ)
+			cpu_run_posted(c);
+	}
+	return true;
+}
+
+static void run_child(struct core *c, uint64_t step_limit, int out) {
+	struct batch_result r = {};
+	const uint64_t start = c->retired;
+	event_fork_child(c);
+	if (!run_until(c, &done, step_limit))
+		r.status = BATCH_HALT;
+	else
+		r.status = done ? BATCH_DONE : BATCH_TIMEOUT;
+	r.value = done_value;
+	r.steps = c->retired - start;
+	write_full(out, &r, sizeof r);
+	_exit(0);
+}
+
+static struct batch_result run_one(struct core *c, uint64_t step_limit) {
+	struct batch_result r = {.status = BATCH_CRASH};
+	int fds[2];
+	if (pipe(fds) < 0) {
+		r.value = SIGABRT;
+		return r;
+	}
+
+	/* a disk request in flight would finish in our copy of guest memory
+	 * only, every child starts with them completed instead */
+	blk_drain(c);
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(fds[0]);
+		run_child(c, step_limit, fds[1]);
+	}
+	close(fds[1]);
+	if (pid < 0) {
+		close(fds[0]);
+		r.value = SIGABRT;
+		return r;
+	}
+
+	bool got = read_full(fds[0], &r, sizeof r);
+	close(fds[0]);
+	int status;
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+	if (!got) {
+		r = (struct batch_result){.status = BATCH_CRASH};
+		r.value = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+	}
+	return r;
+}
+
+int batch_run(struct core *c, uint64_t step_limit) {
+	/* boot has no limit of its own, it ends at the mark or HLT */
+	if (!run_until(c, &marked, UINT64_MAX)) {
+		fprintf(stderr, "batch: guest halted before the mark\n");
+		return 1;
+	}
+
+	uint32_t len;
+	while (read_full(STDIN_FILENO, &len, sizeof len)) {
+		if (len > BATCH_INPUT_MAX) {
+			fprintf(stderr, "batch: input of %u bytes is too large\n", len);
+			return 1;
+		}
+		if (!read_full(STDIN_FILENO, input, len)) {
+			fprintf(stderr, "batch: short input\n");
+			return 1;
+		}
+		input_len = len;
+
+		struct batch_result r = run_one(c, step_limit);
+		if (!write_full(STDOUT_FILENO, &r, sizeof r))
+			return 1;
+	}
+	return 0;
+}
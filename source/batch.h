@@ -0,0 +1,46 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+
+struct core;
+
+/* batch mode. the guest boots until it writes BATCH_REG_MARK, then the VM is
+ * forked once per input read from stdin, so every run starts from the same
+ * copy-on-write state. a run ends when the guest writes BATCH_REG_DONE, halts,
+ * runs out of steps or the child dies.
+ *
+ * stdin:  uint32_t length, then length bytes of input, repeated until EOF
+ * stdout: one struct batch_result per input, in order */
+#define BATCH_BASE 0x90200000UL
+#define BATCH_INPUT_MAX 0x10000
+#define BATCH_SIZE (0x1000 + BATCH_INPUT_MAX)
+
+/* guest visible registers, all 8 bytes wide */
+#define BATCH_REG_MARK 0x00	 /* W: booted, fork from here */
+#define BATCH_REG_DONE 0x08	 /* W: finished, the value is the result */
+#define BATCH_REG_LEN 0x10	 /* R: length of the current input */
+#define BATCH_INPUT 0x1000 /* R: input bytes, zero past the end */
+
+enum batch_status : uint32_t {
+	BATCH_DONE,
+	BATCH_HALT,
+	BATCH_TIMEOUT,
+	BATCH_CRASH, /* value is the signal that killed the run */
+};
+
+struct batch_result {
+	uint32_t status; /* enum batch_status */
+	uint32_t pad;
+	uint64_t value;
+	uint64_t steps; /* instructions run after the mark */
+};
+
+/* false with errno set if the registers can't be mapped */
+bool batch_init(void);
+
+/* boots to the mark and serves inputs until stdin closes, returns the process
+ * exit code */
+int batch_run(struct core *c, uint64_t step_limit);
+
+#endif // BATCH_H
@@ -0,0 +1,238 @@
+#include <bcache.h>
+#include <cpu.h>
+#include <err.h>
+#include <inst.h>
+#include <paging.h>
+#include <stdlib.h>
+#include <string.h>
+
+static inline size_t bucket_of(uintptr_t paddr) {
+	return (paddr ^ (paddr >> 12)) & (BCACHE_BUCKETS - 1);
+}
+
+static inline size_t page_bucket_of(uintptr_t page) {
+	return (page ^ (page >> 12)) & (BCACHE_BUCKETS - 1);
+}
+
+#define LIST_REMOVE(head, b, next)                                             \
+	do {                                                                       \
+		struct block **p_ = (head);                                            \
+		while (*p_ != (b))                                                     \
+			p_ = &(*p_)->next;                                                 \
+		*p_ = (b)->next;                                                       \
+	} while (0)
+
+static inline void mark_code_page(struct core *c, uintptr_t paddr) {
+	struct bcache *bc = c->bcache;
+	uintptr_t p = paddr >> 12;
+	if (p >= bc->npages || bcache_is_code_page(c, paddr))
+		return;
+	bc->code_pages[p >> 3] |= 1u << (p & 7);
+	/* stores to this page have to go through bcache_note_write() now */
+	tlb_flush_page_writes(c, paddr);
+}
+
+/* anything that leaves straight-line execution or changes how the following
+ * bytes are fetched ends the block */
+static bool ends_block(const struct block_inst *bi) {
+	switch (bi->inst.type) {
+	case NO:
+		return true;
+	case OA:
+		if (bi->inst.opcode == CALL)
+			return true;
+		break;
+	default:
+		break;
+	}
+	return bi->dest == PC || (bi->dest >= SP0 && bi->dest != NO_REG);
+}
+
+bool bcache_init(struct core *c) {
+	struct bcache *bc = calloc(1, sizeof *bc);
+	if (bc == nullptr)
+		return false;
+
+	bc->blocks = malloc(BCACHE_BLOCKS * sizeof *bc->blocks);
+	bc->npages = c->mem->cap >> 12;
+	bc->code_pages = calloc((bc->npages + 7) / 8, 1);
+	if (bc->blocks == nullptr || bc->code_pages == nullptr) {
+		free(bc->blocks);
+		free(bc->code_pages);
+		free(bc);
+		return false;
+	}
+	c->bcache = bc;
+	return true;
+}
+
+void bcache_flush(struct core *c) {
+	struct bcache *bc = c->bcache;
+	memset(bc->buckets, 0, sizeof bc->buckets);
+	memset(bc->page_buckets, 0, sizeof bc->page_buckets);
+	memset(bc->code_pages, 0, (bc->npages + 7) / 8);
+	bc->cross = nullptr;
+	bc->used = 0;
+	bc->cur = nullptr;
+	bc->gen++;
+	bc->epoch++;
+	for (int i = 0; i < TLB_ENTRIES; i++)
+		c->tlb.entries[TLB_WRITE][i].vpage = TLB_INVALID;
+}
+
+void bcache_invalidate_page(struct core *c, uintptr_t paddr) {
+	struct bcache *bc = c->bcache;
+	const uintptr_t page = paddr >> 12;
+
+	struct block **prev = &bc->page_buckets[page_bucket_of(page)];
+	while (*prev) {
+		struct block *b = *prev;
+		if ((b->paddr >> 12) != page) {
+			prev = &b->page_next;
+			continue;
+		}
+		*prev = b->page_next;
+		LIST_REMOVE(&bc->buckets[bucket_of(b->paddr)], b, hash_next);
+		if (b->end_page != page)
+			LIST_REMOVE(&bc->cross, b, cross_next);
+	}
+	prev = &bc->cross;
+	while (*prev) {
+		struct block *b = *prev;
+		if (b->end_page != page) {
+			prev = &b->cross_next;
+			continue;
+		}
+		*prev = b->cross_next;
+		LIST_REMOVE(&bc->buckets[bucket_of(b->paddr)], b, hash_next);
+		LIST_REMOVE(&bc->page_buckets[page_bucket_of(b->paddr >> 12)], b,
+					page_next);
+	}
+
+	bc->code_pages[page >> 3] &= ~(1u << (page & 7));
+	bc->cur = nullptr;
+	bc->gen++;
+	tlb_flush_page_writes(c, paddr);
+}
+
+static struct block *decode_block(struct core *c, uint64_t vaddr,
+								  uintptr_t paddr) {
+	struct bcache *bc = c->bcache;
+	struct instruction inst;
+
+	uint64_t pc = vaddr;
+	uint64_t next = parse_instruction(c, &inst, pc, DECODE_RAISE);
+	if (next == 0)
+		return nullptr;
+
+	if (bc->used == BCACHE_BLOCKS)
+		bcache_flush(c);
+	struct block *b = &bc->blocks[bc->used++];
+	b->paddr = paddr;
+	b->count = 0;
+	b->jit = nullptr;
+	b->heat = 0;
+	b->end_page = paddr >> 12;
+	mark_code_page(c, paddr);
+
+	for (;;) {
+		struct block_inst *bi = &b->insts[b->count++];
+		bi->inst = inst;
+		bi->len = next - pc;
+		bi->dest = inst_dest_reg(&inst);
+		bi->handler = cpu_resolve_handler(&inst);
+
+		if (((next - 1) >> 12) != (pc >> 12)) {
+			b->end_page = vaddr_translate(c, next - 1, TLB_EXEC) >> 12;
+			mark_code_page(c, b->end_page << 12);
+		}
+
+		if (ends_block(bi) || b->count == BCACHE_MAX_INSTS)
+			break;
+		pc = next;
+		if ((pc >> 12) != (vaddr >> 12))
+			break;
+
+		vm_error = VM_OK;
+		next = parse_instruction(c, &inst, pc, DECODE_QUIET);
+		if (next == 0 || vm_error != VM_OK)
+			break;
+	}
+
+	cpu_fuse_block(b);
+	size_t h = bucket_of(paddr);
+	b->hash_next = bc->buckets[h];
+	bc->buckets[h] = b;
+	h = page_bucket_of(paddr >> 12);
+	b->page_next = bc->page_buckets[h];
+	bc->page_buckets[h] = b;
+	if (b->end_page != paddr >> 12) {
+		b->cross_next = bc->cross;
+		bc->cross = b;
+	}
+	return b;
+}
+
+/* blocks are shared by every address space, but the last instruction may run
+ * into a page another one maps somewhere else */
+static bool same_end_page(struct core *c, const struct block *b,
+						  uint64_t vaddr) {
+	if (b->end_page == b->paddr >> 12)
+		return true;
+	uint64_t len = 0;
+	for (uint32_t i = 0; i < b->count; i++)
+		len += b->insts[i].len;
+	vm_error = VM_OK;
+	uintptr_t end = vaddr_translate(c, vaddr + len - 1, TLB_EXEC);
+	bool same = vm_error == VM_OK && end >> 12 == b->end_page;
+	vm_error = VM_OK;
+	return same;
+}
+
+const struct block *bcache_lookup(struct core *c, uint64_t vaddr) {
+	struct bcache *bc = c->bcache;
+
+	vm_error = VM_OK;
+	uintptr_t paddr = vaddr_translate(c, vaddr, TLB_EXEC);
+	if (vm_error != VM_OK || paddr >= c->mem->cap) {
+		/* not plain RAM, decode without caching */
+		struct block_inst *bi = &bc->uncached.insts[0];
+		uint64_t next = parse_instruction(c, &bi->inst, vaddr, DECODE_RAISE);
+		if (next == 0)
+			return nullptr;
+		bi->len = next - vaddr;
+		bi->dest = inst_dest_reg(&bi->inst);
+		bi->handler = cpu_resolve_handler(&bi->inst);
+		bc->uncached.count = 1;
+		return &bc->uncached;
+	}
+
+	struct block *b;
+	for (b = bc->buckets[bucket_of(paddr)]; b; b = b->hash_next)
+		if (b->paddr == paddr && same_end_page(c, b, vaddr))
+			return b;
+	return decode_block(c, vaddr, paddr);
+}
+
+const struct block_inst *bcache_fetch(struct core *c, uint64_t vaddr) {
+	struct bcache *bc = c->bcache;
+
+	if (bc->cur != nullptr && bc->cur_pc == vaddr &&
+		bc->cur_idx < bc->cur->count) {
+		const struct block_inst *bi = &bc->cur->insts[bc->cur_idx++];
+		bc->cur_pc += bi->len;
+		return bi;
+	}
+	bc->cur = nullptr;
+
+	const struct block *b = bcache_lookup(c, vaddr);
+	if (b == nullptr)
+		return nullptr;
+
+	if (b != &bc->uncached) {
+		bc->cur = (struct block *)b;
+		bc->cur_idx = 1;
+		bc->cur_pc = vaddr + b->insts[0].len;
+	}
+	return &b->insts[0];
+}
@@ -0,0 +1,87 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <cpu.h>
+#include <inst.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BCACHE_MAX_INSTS 32
+#define BCACHE_BLOCKS 4096
+#define BCACHE_BUCKETS 4096
+
+struct block_inst {
+	struct instruction inst;
+	uint8_t len;
+	uint8_t dest;	 /* inst_dest_reg() */
+	uint8_t handler; /* cpu_resolve_handler() */
+};
+
+/* decoded basic block, keyed by the physical address of its first byte */
+struct block {
+	uintptr_t paddr;
+	uintptr_t end_page; /* physical page of the last byte */
+	uint32_t count;
+	struct block *hash_next;
+	struct block *page_next;  /* same page_buckets[] slot */
+	struct block *cross_next; /* on bcache.cross */
+	uint8_t *jit;		/* host code, nullptr until jit_compile() */
+	uint64_t jit_vaddr; /* PC the host code was compiled for */
+	uint32_t heat;		/* times looked up by jit_run() */
+	struct block_inst insts[BCACHE_MAX_INSTS];
+};
+
+struct bcache {
+	struct block *buckets[BCACHE_BUCKETS];
+	/* blocks by the page they start on, and the ones whose last instruction
+	 * runs into the next page, so a store to code drops only what it hit */
+	struct block *page_buckets[BCACHE_BUCKETS];
+	struct block *cross;
+	struct block *blocks;
+	uint32_t used;
+	uint64_t gen;	/* bumped whenever blocks are dropped */
+	uint64_t epoch; /* bumped when all of them are */
+
+	/* execution cursor, valid while PC keeps following the block */
+	struct block *cur;
+	uint32_t cur_idx;
+	uint64_t cur_pc;
+	struct block uncached;
+
+	/* one bit per physical page holding decoded code */
+	uint8_t *code_pages;
+	uintptr_t npages;
+};
+
+bool bcache_init(struct core *c);
+void bcache_flush(struct core *c);
+void bcache_invalidate_page(struct core *c, uintptr_t paddr);
+
+/* both return nullptr if decoding raised an interrupt */
+const struct block *bcache_lookup(struct core *c, uint64_t vaddr);
+const struct block_inst *bcache_fetch(struct core *c, uint64_t vaddr);
+
+/* true when the next bcache_fetch() starts a new block */
+static inline bool bcache_at_boundary(const struct bcache *bc) {
+	return bc->cur == nullptr || bc->cur_idx >= bc->cur->count;
+}
+
+static inline bool bcache_is_code_page(struct core *c, uintptr_t paddr) {
+	struct bcache *bc = c->bcache;
+	uintptr_t p = paddr >> 12;
+	return bc != nullptr && p < bc->npages &&
+		   (bc->code_pages[p >> 3] & (1u << (p & 7)));
+}
+
+static inline void bcache_note_write(struct core *c, uintptr_t paddr,
+									 size_t len) {
+	struct bcache *bc = c->bcache;
+	if (bc == nullptr)
+		return;
+	for (uintptr_t p = paddr >> 12; p <= (paddr + len - 1) >> 12; p++) {
+		if (bcache_is_code_page(c, p << 12))
+			bcache_invalidate_page(c, p << 12);
+	}
+}
+
+#endif // BCACHE_H
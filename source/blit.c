@@ -0,0 +1,179 @@
+#include <blit.h>
+#include <cpu.h>
+#include <mmio.h>
+#include <paging.h>
+#include <snapshot.h>
+#include <string.h>
+
+static struct {
+	uint64_t dst, src;
+	uint64_t dst_pitch, src_pitch;
+	uint64_t width, height;
+	uint64_t value;
+	uint64_t status;
+	uint64_t ctrl;
+} regs;
+
+/* bytes spanned by height rows of row bytes, 0 if it doesn't fit */
+static uint64_t rect_span(uint64_t row, uint64_t height, uint64_t pitch) {
+	if (row == 0 || height == 0)
+		return 0;
+	if (height > 1 &&
+		(pitch < row || height - 1 > (UINT64_MAX - row) / pitch))
+		return 0;
+	return (height - 1) * pitch + row;
+}
+
+static bool fill_rect(struct core *c) {
+	if (regs.width > UINT64_MAX / 4)
+		return false;
+	const uint64_t row = regs.width * 4;
+	const uint64_t span = rect_span(row, regs.height, regs.dst_pitch);
+	uint8_t *dst = span ? phys_dma_map(c, regs.dst, span) : nullptr;
+	if (dst == nullptr)
+		return false;
+
+	const uint32_t v = regs.value;
+	uint8_t *p = dst;
+	for (uint64_t x = 0; x < regs.width; x++)
+		memcpy(p + x * 4, &v, 4);
+	for (uint64_t y = 1; y < regs.height; y++)
+		memcpy(p + y * regs.dst_pitch, p, row);
+	phys_dma_written(c, regs.dst, span);
+	return true;
+}
+
+static bool copy_rect(struct core *c) {
+	if (regs.width > UINT64_MAX / 4)
+		return false;
+	const uint64_t row = regs.width * 4;
+	const uint64_t dspan = rect_span(row, regs.height, regs.dst_pitch);
+	const uint64_t sspan = rect_span(row, regs.height, regs.src_pitch);
+	uint8_t *dst = dspan ? phys_dma_map(c, regs.dst, dspan) : nullptr;
+	const uint8_t *src = sspan ? phys_dma_map(c, regs.src, sspan) : nullptr;
+	if (dst == nullptr || src == nullptr)
+		return false;
+
+	/* overlapping rects scroll either way */
+	if (dst <= src) {
+		for (uint64_t y = 0; y < regs.height; y++)
+			memmove(dst + y * regs.dst_pitch, src + y * regs.src_pitch, row);
+	} else {
+		for (uint64_t y = regs.height; y-- > 0;)
+			memmove(dst + y * regs.dst_pitch, src + y * regs.src_pitch, row);
+	}
+	phys_dma_written(c, regs.dst, dspan);
+	return true;
+}
+
+static bool copy(struct core *c) {
+	uint8_t *dst = phys_dma_map(c, regs.dst, regs.width);
+	const uint8_t *src = phys_dma_map(c, regs.src, regs.width);
+	if (regs.width == 0 || dst == nullptr || src == nullptr)
+		return false;
+	memmove(dst, src, regs.width);
+	phys_dma_written(c, regs.dst, regs.width);
+	return true;
+}
+
+static bool set(struct core *c) {
+	uint8_t *dst = phys_dma_map(c, regs.dst, regs.width);
+	if (regs.width == 0 || dst == nullptr)
+		return false;
+	memset(dst, (uint8_t)regs.value, regs.width);
+	phys_dma_written(c, regs.dst, regs.width);
+	return true;
+}
+
+static void run(struct core *c, uint64_t cmd) {
+	bool ok = false;
+	switch ((enum blit_cmd)cmd) {
+	case BLIT_FILL_RECT:
+		ok = fill_rect(c);
+		break;
+	case BLIT_COPY_RECT:
+		ok = copy_rect(c);
+		break;
+	case BLIT_COPY:
+		ok = copy(c);
+		break;
+	case BLIT_SET:
+		ok = set(c);
+		break;
+	}
+	regs.status |= ok ? BLIT_STATUS_DONE : BLIT_STATUS_ERROR;
+	/* raised once this store has retired */
+	if (regs.ctrl & BLIT_CTRL_IRQ)
+		cpu_post_irq(c, ICR_BLIT);
+}
+
+static uint64_t *reg(uintptr_t offset) {
+	switch (offset) {
+	case BLIT_REG_DST:
+		return &regs.dst;
+	case BLIT_REG_SRC:
+		return &regs.src;
+	case BLIT_REG_DST_PITCH:
+		return &regs.dst_pitch;
+	case BLIT_REG_SRC_PITCH:
+		return &regs.src_pitch;
+	case BLIT_REG_WIDTH:
+		return &regs.width;
+	case BLIT_REG_HEIGHT:
+		return &regs.height;
+	case BLIT_REG_VALUE:
+		return &regs.value;
+	case BLIT_REG_STATUS:
+		return &regs.status;
+	case BLIT_REG_CTRL:
+		return &regs.ctrl;
+	default:
+		return nullptr;
+	}
+}
+
+static bool blit_read(struct core *, uintptr_t offset, void *buf,
+					  size_t len) {
+	memset(buf, 0, len);
+	uint64_t *r = reg(offset);
+	if (r != nullptr && len == 8)
+		memcpy(buf, r, sizeof *r);
+	return true;
+}
+
+static bool blit_write(struct core *c, uintptr_t offset, const void *buf,
+					   size_t len) {
+	if (len != 8)
+		return true;
+	uint64_t v;
+	memcpy(&v, buf, sizeof v);
+	if (offset == BLIT_REG_CMD) {
+		run(c, v);
+	} else if (offset == BLIT_REG_STATUS) {
+		regs.status = 0;
+	} else {
+		uint64_t *r = reg(offset);
+		if (r != nullptr)
+			*r = v;
+	}
+	return true;
+}
+
+bool blit_init(void) {
+	static struct mmio_hook hook = {
+		.base = BLIT_BASE,
+		.size = BLIT_SIZE,
+		.read = blit_read,
+		.write = blit_write,
+		.next = nullptr,
+	};
+	static struct snapshot_dev dev = {
+		.name = "blit",
+		.data = &regs,
+		.size = sizeof regs,
+	};
+	if (!register_mmio_hook(&hook))
+		return false;
+	snapshot_register(&dev);
+	return true;
+}
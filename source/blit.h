@@ -0,0 +1,41 @@
+#ifndef BLIT_H
+#define BLIT_H
+
+#include <stdint.h>
+
+/* 2D blitter and DMA engine. the guest fills in the registers and writes a
+ * command, which runs to completion on the host before the store returns.
+ * addresses are physical and every byte touched has to be plain RAM or one
+ * RAM backed device, otherwise nothing is done and BLIT_STATUS_ERROR is set */
+#define BLIT_BASE 0x90230000UL
+#define BLIT_SIZE 0x50
+
+/* guest visible registers, all 8 bytes wide */
+#define BLIT_REG_CMD 0x00		/* W: enum blit_cmd, starts it */
+#define BLIT_REG_DST 0x08		/* RW */
+#define BLIT_REG_SRC 0x10		/* RW */
+#define BLIT_REG_DST_PITCH 0x18 /* RW: bytes between rows */
+#define BLIT_REG_SRC_PITCH 0x20 /* RW */
+#define BLIT_REG_WIDTH 0x28		/* RW: pixels, or bytes for the linear ones */
+#define BLIT_REG_HEIGHT 0x30	/* RW: rows */
+#define BLIT_REG_VALUE 0x38		/* RW: fill pixel, or the byte for SET */
+#define BLIT_REG_STATUS 0x40	/* R: BLIT_STATUS_*, W: clears */
+#define BLIT_REG_CTRL 0x48		/* RW: BLIT_CTRL_* */
+
+enum blit_cmd : uint64_t {
+	BLIT_FILL_RECT = 1, /* 32 bit VALUE into WIDTH x HEIGHT at DST */
+	BLIT_COPY_RECT = 2, /* WIDTH x HEIGHT 32 bit pixels from SRC to DST */
+	BLIT_COPY = 3,		/* WIDTH bytes from SRC to DST, may overlap */
+	BLIT_SET = 4,		/* WIDTH bytes of VALUE at DST */
+};
+
+#define BLIT_STATUS_DONE (1u << 0)
+#define BLIT_STATUS_ERROR (1u << 1)
+#define BLIT_CTRL_IRQ (1u << 0) /* raise ICR_BLIT when a command finishes */
+
+#define ICR_BLIT 15 /* IRC5 */
+
+/* false with errno set if the registers can't be mapped */
+bool blit_init(void);
+
+#endif // BLIT_H
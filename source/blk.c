@@ -0,0 +1,377 @@
+#include <blk.h>
+#include <cpu.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <map.h>
+#include <mmio.h>
+#include <paging.h>
+#include <pthread.h>
+#include <snapshot.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* no io_uring without liburing here, a few threads doing pread/pwrite keep
+ * the CPU thread off the disk just as well */
+#define BLK_THREADS 4
+
+struct blk_job {
+	uint16_t id;
+	uint16_t op;
+	uint16_t status;
+	uint32_t len;
+	uint64_t offset;
+	uintptr_t paddr;
+	uint8_t *host;
+};
+
+static struct {
+	uint64_t ring;
+	uint64_t ring_size;
+	uint64_t ctrl;
+	uint64_t isr;
+	uint64_t last_avail; /* next avail entry to take */
+} regs;
+
+static struct core *core;
+static int fd = -1;
+static uint64_t capacity; /* sectors */
+
+/* copy-on-write mode: the file is only read, written sectors are kept here.
+ * a forked child gets its own copy of the map with the rest of its memory */
+static bool cow;
+static pthread_mutex_t overlay_lock = PTHREAD_MUTEX_INITIALIZER;
+static map_of(uint64_t, uint8_t *) overlay;
+
+/* queued and finished jobs, inflight bounds both */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cv = PTHREAD_COND_INITIALIZER;
+static struct blk_job todo[BLK_RING_MAX], done[BLK_RING_MAX];
+static uint32_t todo_head, todo_tail, done_head, done_tail;
+static uint32_t inflight; /* CPU thread only */
+static bool started;
+
+static void complete(struct core *c);
+static struct cpu_work complete_work = {.fn = complete};
+
+struct ring {
+	struct blk_desc *desc;
+	uint16_t *avail_idx, *avail;
+	uint16_t *used_idx;
+	struct blk_used *used;
+	size_t size;
+};
+
+static bool map_ring(struct core *c, struct ring *r) {
+	const uint64_t n = regs.ring_size;
+	if (n == 0 || n > BLK_RING_MAX || (n & (n - 1)) || (regs.ring & 7))
+		return false;
+	const size_t avail = n * sizeof(struct blk_desc);
+	const size_t used = (avail + 2 * (n + 1) + 7) & ~7ULL;
+	r->size = used + 4 + n * sizeof(struct blk_used);
+	uint8_t *p = phys_dma_map(c, regs.ring, r->size);
+	if (p == nullptr)
+		return false;
+	r->desc = (struct blk_desc *)p;
+	r->avail_idx = (uint16_t *)(p + avail);
+	r->avail = r->avail_idx + 1;
+	r->used_idx = (uint16_t *)(p + used);
+	r->used = (struct blk_used *)(p + used + 4);
+	return true;
+}
+
+static bool transfer(bool write, uint8_t *buf, size_t len, uint64_t offset) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = write ? pwrite(fd, buf + done, len - done, offset + done)
+						  : pread(fd, buf + done, len - done, offset + done);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+static size_t sector_hash(uint64_t sector) {
+	return (sector * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+static int sector_eq(uint64_t a, uint64_t b) { return a == b; }
+
+static uint16_t cow_job(const struct blk_job *j) {
+	const uint64_t first = j->offset / BLK_SECTOR;
+	const uint32_t count = j->len / BLK_SECTOR;
+	if (j->op == BLK_READ && !transfer(false, j->host, j->len, j->offset))
+		return BLK_IOERR;
+
+	uint16_t status = BLK_OK;
+	pthread_mutex_lock(&overlay_lock);
+	for (uint32_t i = 0; i < count; i++) {
+		uint8_t *buf = j->host + (size_t)i * BLK_SECTOR;
+		uint8_t **s = map_get(&overlay, first + i);
+		if (j->op == BLK_READ) {
+			if (s != nullptr)
+				memcpy(buf, *s, BLK_SECTOR);
+			continue;
+		}
+		if (s == nullptr) {
+			uint8_t *copy = malloc(BLK_SECTOR);
+			if (copy == nullptr) {
+				status = BLK_IOERR;
+				break;
+			}
+			map_put(&overlay, first + i, copy);
+			s = map_get(&overlay, first + i);
+		}
+		memcpy(*s, buf, BLK_SECTOR);
+	}
+	pthread_mutex_unlock(&overlay_lock);
+	return status;
+}
+
+static uint16_t run_job(const struct blk_job *j) {
+	if (j->op == BLK_FLUSH)
+		return cow || fdatasync(fd) == 0 ? BLK_OK : BLK_IOERR;
+	if (cow)
+		return cow_job(j);
+	return transfer(j->op == BLK_WRITE, j->host, j->len, j->offset)
+			   ? BLK_OK
+			   : BLK_IOERR;
+}
+
+static void *worker(void *) {
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (todo_head == todo_tail)
+			pthread_cond_wait(&work_cv, &lock);
+		struct blk_job j = todo[todo_head++ % BLK_RING_MAX];
+		pthread_mutex_unlock(&lock);
+
+		j.status = run_job(&j);
+
+		pthread_mutex_lock(&lock);
+		done[done_tail++ % BLK_RING_MAX] = j;
+		pthread_cond_signal(&done_cv);
+		cpu_post_work(core, &complete_work);
+	}
+	return nullptr;
+}
+
+/* with lock held. the condition variables may still count the waiters of a
+ * parent's threads, no thread of ours waits on them yet */
+static void start_workers(void) {
+	if (started)
+		return;
+	started = true;
+	pthread_cond_init(&work_cv, nullptr);
+	pthread_cond_init(&done_cv, nullptr);
+	for (int i = 0; i < BLK_THREADS; i++) {
+		pthread_t t;
+		if (pthread_create(&t, nullptr, worker, nullptr) == 0)
+			pthread_detach(t);
+	}
+}
+
+static bool prepare(struct core *c, const struct blk_desc *d,
+					struct blk_job *j) {
+	j->op = d->op;
+	j->len = d->len;
+	j->paddr = d->addr;
+	if (d->op == BLK_FLUSH)
+		return true;
+	if ((d->op != BLK_READ && d->op != BLK_WRITE) || d->len == 0 ||
+		d->len % BLK_SECTOR != 0 || d->sector > capacity ||
+		d->len / BLK_SECTOR > capacity - d->sector)
+		return false;
+	j->offset = d->sector * BLK_SECTOR;
+	j->host = phys_dma_map(c, d->addr, d->len);
+	return j->host != nullptr;
+}
+
+/* hands everything new in avail to the workers in one go, bad requests go
+ * straight to done */
+static void kick(struct core *c) {
+	struct ring r;
+	if (!map_ring(c, &r))
+		return;
+
+	bool queued = false, failed = false;
+	pthread_mutex_lock(&lock);
+	while ((uint16_t)regs.last_avail != *r.avail_idx &&
+		   inflight < regs.ring_size) {
+		struct blk_job j = {
+			.id = r.avail[regs.last_avail++ % regs.ring_size],
+		};
+		inflight++;
+		if (j.id < regs.ring_size && prepare(c, &r.desc[j.id], &j)) {
+			todo[todo_tail++ % BLK_RING_MAX] = j;
+			queued = true;
+		} else {
+			j.status = BLK_UNSUPP;
+			done[done_tail++ % BLK_RING_MAX] = j;
+			failed = true;
+		}
+	}
+	if (queued) {
+		start_workers();
+		pthread_cond_broadcast(&work_cv);
+	}
+	pthread_mutex_unlock(&lock);
+	if (failed)
+		cpu_post_work(c, &complete_work);
+}
+
+static void complete(struct core *c) {
+	struct ring r;
+	const bool mapped = map_ring(c, &r);
+	bool any = false;
+
+	pthread_mutex_lock(&lock);
+	while (done_head != done_tail) {
+		const struct blk_job j = done[done_head++ % BLK_RING_MAX];
+		inflight--;
+		if (j.op == BLK_READ && j.status == BLK_OK)
+			phys_dma_written(c, j.paddr, j.len);
+		if (!mapped)
+			continue;
+		if (j.id < regs.ring_size)
+			r.desc[j.id].status = j.status;
+		struct blk_used *u = &r.used[*r.used_idx % regs.ring_size];
+		u->id = j.id;
+		u->len = j.status == BLK_OK && j.op != BLK_FLUSH ? j.len : 0;
+		(*r.used_idx)++;
+		any = true;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (!any)
+		return;
+	phys_dma_written(c, regs.ring, r.size);
+	regs.isr |= BLK_ISR_USED;
+	if (regs.ctrl & BLK_CTRL_IRQ)
+		cpu_post_irq(c, ICR_DISK);
+	/* requests that didn't fit while the ring was full */
+	if ((uint16_t)regs.last_avail != *r.avail_idx)
+		kick(c);
+}
+
+static uint64_t *reg(uintptr_t offset) {
+	switch (offset) {
+	case BLK_REG_RING:
+		return &regs.ring;
+	case BLK_REG_RING_SIZE:
+		return &regs.ring_size;
+	case BLK_REG_CTRL:
+		return &regs.ctrl;
+	case BLK_REG_ISR:
+		return &regs.isr;
+	default:
+		return nullptr;
+	}
+}
+
+static bool blk_read(struct core *, uintptr_t offset, void *buf, size_t len) {
+	memset(buf, 0, len);
+	if (len != 8)
+		return true;
+	if (offset == BLK_REG_CAPACITY) {
+		memcpy(buf, &capacity, sizeof capacity);
+	} else {
+		uint64_t *r = reg(offset);
+		if (r != nullptr)
+			memcpy(buf, r, sizeof *r);
+	}
+	return true;
+}
+
+static bool blk_write(struct core *c, uintptr_t offset, const void *buf,
+					  size_t len) {
+	if (len != 8)
+		return true;
+	uint64_t v;
+	memcpy(&v, buf, sizeof v);
+	if (offset == BLK_REG_DOORBELL) {
+		kick(c);
+	} else if (offset == BLK_REG_ISR) {
+		regs.isr &= ~v;
+	} else if (offset == BLK_REG_RING) {
+		/* a new ring starts from its first entry */
+		regs.ring = v;
+		regs.last_avail = 0;
+	} else if (offset == BLK_REG_CTRL || offset == BLK_REG_RING_SIZE) {
+		*reg(offset) = v;
+	}
+	return true;
+}
+
+void blk_drain(struct core *c) {
+	while (inflight != 0) {
+		pthread_mutex_lock(&lock);
+		while (done_tail - done_head != inflight)
+			pthread_cond_wait(&done_cv, &lock);
+		pthread_mutex_unlock(&lock);
+		/* may kick requests that didn't fit in before */
+		complete(c);
+	}
+}
+
+/* lock is held across fork() so the child gets it unlocked, the queues are
+ * empty after blk_drain(). threads don't survive, the child starts its own
+ * with its first request */
+static void before_fork(void) { pthread_mutex_lock(&lock); }
+
+static void after_fork_parent(void) { pthread_mutex_unlock(&lock); }
+
+static void after_fork_child(void) {
+	started = false;
+	pthread_mutex_unlock(&lock);
+}
+
+bool blk_init(struct core *c, const char *path, bool copy_on_write) {
+	cow = copy_on_write;
+	fd = cow ? -1 : open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0 && (cow || errno == EACCES || errno == EROFS))
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	if (cow && !map_init(&overlay, sector_hash, sector_eq)) {
+		close(fd);
+		fd = -1;
+		errno = ENOMEM;
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		fd = -1;
+		return false;
+	}
+	capacity = st.st_size / BLK_SECTOR;
+	core = c;
+
+	static struct mmio_hook hook = {
+		.base = BLK_BASE,
+		.size = BLK_SIZE,
+		.read = blk_read,
+		.write = blk_write,
+		.next = nullptr,
+	};
+	static struct snapshot_dev dev = {
+		.name = "blk",
+		.data = &regs,
+		.size = sizeof regs,
+		.quiesce = blk_drain,
+	};
+	if (!register_mmio_hook(&hook)) {
+		close(fd);
+		fd = -1;
+		return false;
+	}
+	snapshot_register(&dev);
+	pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+	return true;
+}
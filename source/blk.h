@@ -0,0 +1,76 @@
+#ifndef BLK_H
+#define BLK_H
+
+#include <stdint.h>
+
+struct core;
+
+/* block device backed by a host file. requests sit in a ring in guest memory:
+ *
+ *   struct blk_desc desc[size];
+ *   uint16_t avail_idx, avail[size];      guest: descriptor numbers to run
+ *   (8 byte aligned)
+ *   uint16_t used_idx, pad;               device: finished ones
+ *   struct blk_used used[size];
+ *
+ * the guest fills descriptors, appends them to avail, bumps avail_idx and
+ * writes the doorbell once for the whole batch. host threads do the I/O, the
+ * CPU thread appends each finished request to used, bumps used_idx, sets
+ * BLK_ISR_USED and raises ICR_DISK if enabled. a descriptor, its buffer and
+ * the ring belong to the device until the request shows up in used. snapshots
+ * and batch forks wait for the requests in flight first */
+#define BLK_BASE 0x90240000UL
+#define BLK_SIZE 0x30
+
+/* guest visible registers, all 8 bytes wide */
+#define BLK_REG_RING 0x00	   /* RW: physical address, 8 byte aligned */
+#define BLK_REG_RING_SIZE 0x08 /* RW: entries, a power of 2 to BLK_RING_MAX */
+#define BLK_REG_DOORBELL 0x10  /* W: avail_idx moved */
+#define BLK_REG_CAPACITY 0x18  /* R: sectors */
+#define BLK_REG_CTRL 0x20	   /* RW: BLK_CTRL_* */
+#define BLK_REG_ISR 0x28	   /* R: BLK_ISR_*, W: clears the bits set */
+
+#define BLK_SECTOR 512
+#define BLK_RING_MAX 256
+#define BLK_CTRL_IRQ (1u << 0)
+#define BLK_ISR_USED (1u << 0)
+
+#define ICR_DISK 12 /* IRC2 */
+
+enum blk_op : uint16_t {
+	BLK_READ,
+	BLK_WRITE,
+	BLK_FLUSH,
+};
+
+enum blk_status : uint16_t {
+	BLK_OK,
+	BLK_IOERR,
+	BLK_UNSUPP, /* bad op, range or buffer */
+};
+
+struct blk_desc {
+	uint64_t sector;
+	uint64_t addr;	 /* physical */
+	uint32_t len;	 /* bytes, a multiple of BLK_SECTOR */
+	uint16_t op;	 /* enum blk_op */
+	uint16_t status; /* enum blk_status, written by the device */
+};
+
+struct blk_used {
+	uint32_t id;  /* descriptor number */
+	uint32_t len; /* bytes transferred */
+};
+
+/* false with errno set if the file can't be opened or the registers can't be
+ * mapped. read only files work, writes to them fail with BLK_IOERR. with
+ * copy_on_write the file is opened read only and writes are kept in memory,
+ * batch mode uses it so no run sees what another one wrote */
+bool blk_init(struct core *c, const char *path, bool copy_on_write);
+
+/* waits for every request in flight and completes it into the ring, so no
+ * host thread touches guest memory until the next doorbell. CPU thread only,
+ * fork() must not happen with requests in flight */
+void blk_drain(struct core *c);
+
+#endif // BLK_H
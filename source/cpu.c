@@ -1,7 +1,10 @@
 #include <assert.h>
+#include <bcache.h>
 #include <cpu.h>
+#include <events.h>
 #include <inst.h>
 #include <interrupt.h>
+#include <jit.h>
 #include <ncurses.h>
 #include <paging.h>
 #include <stdio.h>
@@ -22,34 +25,87 @@ static inline void set_sp(struct core *c, uint64_t v) {
 		c->registers[SP0] = v;
 }
 
-static void update_arith_flags(struct core *c, uint64_t res, uint64_t, uint64_t,
-							   bool carry, bool overflow) {
-	uint64_t fr = c->registers[FR] & ~(FLAG_CF | FLAG_OF | FLAG_ZF | FLAG_SF);
-	if (carry)
-		fr |= FLAG_CF;
-	if (overflow)
-		fr |= FLAG_OF;
-	if (res == 0)
-		fr |= FLAG_ZF;
-	if ((int64_t)res < 0)
-		fr |= FLAG_SF;
-	c->registers[FR] = fr;
+static inline void set_flags(struct core *c, enum flags_op op, uint64_t res,
+							 uint64_t a, uint64_t b) {
+	c->flags.res = res;
+	c->flags.a = a;
+	c->flags.b = b;
+	c->flags.op = op;
+}
+
+static inline bool flags_overflow(const struct lazy_flags *f) {
+	const int64_t a = f->a, b = f->b, res = f->res;
+	switch (f->op) {
+	case FLAGS_ADD:
+		return (a > 0 && b > 0 && res < 0) || (a < 0 && b < 0 && res > 0);
+	case FLAGS_SUB:
+		return (a > 0 && b < 0 && res < 0) || (a < 0 && b > 0 && res > 0);
+	default:
+		return false;
+	}
+}
+
+static inline bool flags_carry(const struct lazy_flags *f) {
+	switch (f->op) {
+	case FLAGS_ADD:
+		return f->res < f->a;
+	case FLAGS_SUB:
+		return f->a < f->b; /* borrow */
+	case FLAGS_MUL:
+		return f->b != 0 && f->res / f->b != f->a;
+	default:
+		return false;
+	}
 }
 
-static void update_logic_flags(struct core *c, uint64_t res) {
+uint64_t cpu_sync_flags(struct core *c) {
+	struct lazy_flags *f = &c->flags;
+	if (f->op == FLAGS_NONE)
+		return c->registers[FR];
+
 	uint64_t fr = c->registers[FR] & ~(FLAG_ZF | FLAG_SF);
-	if (res == 0)
+	if (f->op != FLAGS_LOGIC) {
+		fr &= ~(FLAG_CF | FLAG_OF);
+		if (flags_carry(f))
+			fr |= FLAG_CF;
+		if (flags_overflow(f))
+			fr |= FLAG_OF;
+	}
+	if (f->res == 0)
 		fr |= FLAG_ZF;
-	if ((int64_t)res < 0)
+	if ((int64_t)f->res < 0)
 		fr |= FLAG_SF;
-	c->registers[FR] = fr;
+	f->op = FLAGS_NONE;
+	return c->registers[FR] = fr;
+}
+
+/* DIV leaves all four flags clear */
+static inline void clear_flags(struct core *c) {
+	c->flags.op = FLAGS_NONE;
+	c->registers[FR] &= ~(FLAG_CF | FLAG_OF | FLAG_ZF | FLAG_SF);
+}
+
+static inline void update_logic_flags(struct core *c, uint64_t res) {
+	/* CF/OF of a pending arithmetic op have to survive */
+	if (c->flags.op != FLAGS_NONE && c->flags.op != FLAGS_LOGIC)
+		cpu_sync_flags(c);
+	set_flags(c, FLAGS_LOGIC, res, 0, 0);
 }
 
 static bool cond_ok(struct core *c, enum cmove_argument_mode cond) {
-	uint64_t fr = c->registers[FR];
-	bool z = (fr & FLAG_ZF) != 0;
-	bool s = (fr & FLAG_SF) != 0;
-	bool o = (fr & FLAG_OF) != 0;
+	const struct lazy_flags *f = &c->flags;
+	bool z, s, o;
+	if (f->op == FLAGS_NONE) {
+		uint64_t fr = c->registers[FR];
+		z = (fr & FLAG_ZF) != 0;
+		s = (fr & FLAG_SF) != 0;
+		o = (fr & FLAG_OF) != 0;
+	} else {
+		z = f->res == 0;
+		s = (int64_t)f->res < 0;
+		o = f->op == FLAGS_LOGIC ? (c->registers[FR] & FLAG_OF) != 0
+								 : flags_overflow(f);
+	}
 	switch (cond) {
 	case NE:
 		return !z;
@@ -68,42 +124,127 @@ static bool cond_ok(struct core *c, enum cmove_argument_mode cond) {
 	}
 }
 
-void cpu_init(struct core *c, struct ram *mem) {
+static inline uint64_t alu_add(struct core *c, uint64_t a, uint64_t b) {
+	uint64_t res = a + b;
+	set_flags(c, FLAGS_ADD, res, a, b);
+	return res;
+}
+
+static inline uint64_t alu_sub(struct core *c, uint64_t a, uint64_t b) {
+	uint64_t res = a - b;
+	set_flags(c, FLAGS_SUB, res, a, b);
+	return res;
+}
+
+static inline uint64_t alu_mul(struct core *c, uint64_t a, uint64_t b) {
+	uint64_t res = a * b;
+	set_flags(c, FLAGS_MUL, res, a, b);
+	return res;
+}
+
+/* instructions naming FR as an operand see and replace the whole register */
+static bool uses_fr(const struct instruction *inst) {
+	switch (inst->type) {
+	case RR:
+		return inst->register_register.reg1 == FR ||
+			   inst->register_register.reg2 == FR;
+	case RM:
+		/* COANDSW compares against the register number, not its value */
+		return inst->opcode != COANDSW && inst->register_memory.reg1 == FR;
+	case RI:
+		return inst->register_imm.reg1 == FR;
+	case OA:
+		return inst->one_arg.mode == REGISTER && inst->one_arg.reg == FR;
+	case CM:
+		return inst->cmove.reg1 == FR || inst->cmove.reg2 == FR;
+	default:
+		return false;
+	}
+}
+
+enum handler_id : uint8_t {
+	H_GENERIC, /* rare or faulting instructions, handed to cpu_execute() */
+	H_SYNC_FLAGS, /* like H_GENERIC, with FR brought up to date first */
+	H_MOV_RR,
+	H_MOV_RM,
+	H_MOV_RI,
+	H_STR_RR,
+	H_STR_RI,
+	H_ADD_RR,
+	H_ADD_RI,
+	H_SUB_RR,
+	H_SUB_RI,
+	H_MUL_RR,
+	H_MUL_RI,
+	H_DIV_RR,
+	H_DIV_RI,
+	H_OR_RR,
+	H_OR_RI,
+	H_AND_RR,
+	H_AND_RI,
+	H_XOR_RR,
+	H_XOR_RI,
+	H_NOT_RR,
+	H_NOT_RI,
+	H_PUSH_R,
+	H_PUSH_I,
+	H_POP_R,
+	H_CALL_R,
+	H_CALL_I,
+	H_CALL_A,
+	H_CMP_RR,
+	H_CMP_RI,
+	H_CMOV,
+	/* cmp, mov rX, label, cmov cc, pc, rX run as one branch */
+	H_BRANCH_RR,
+	H_BRANCH_RI,
+	H_COUNT,
+};
+
+bool cpu_init(struct core *c, struct ram *mem) {
 	memset(c, 0, sizeof(*c));
 	c->mem = mem;
 	c->irc = malloc(sizeof *c->irc);
+	if (c->irc == nullptr)
+		return false;
 	irc_init(c->irc, c);
+	if (!bcache_init(c)) {
+		free(c->irc);
+		c->irc = nullptr;
+		return false;
+	}
+	tlb_flush(&c->tlb);
+	c->deadline = EVENT_NEVER;
 	c->registers[SP1] = mem->cap;
 	c->registers[SP0] = mem->cap - 0x1000;
 	c->registers[PC] = 0;
+	return true;
 }
 
-bool cpu_step(struct core *c) {
-	uint64_t old_pc = c->registers[PC];
-	struct instruction inst;
-	uint64_t next_pc = parse_instruction(c, &inst, old_pc);
+static bool cpu_execute(struct core *c, const struct instruction *inst,
+						uint64_t old_pc, uint64_t next_pc) {
 	c->registers[PC] = next_pc;
 
 	uint64_t a, b, res, sp, addr;
 	uint8_t r1, r2;
 
-	switch (inst.opcode) {
+	switch (inst->opcode) {
 
 	case MOV:
-		switch (inst.type) {
+		switch (inst->type) {
 		case RR:
-			r1 = inst.register_register.reg1;
-			r2 = inst.register_register.reg2;
+			r1 = inst->register_register.reg1;
+			r2 = inst->register_register.reg2;
 			c->registers[r1] = c->registers[r2];
 			break;
 		case RM:
-			r1 = inst.register_memory.reg1;
-			addr = inst.register_memory.address;
+			r1 = inst->register_memory.reg1;
+			addr = inst->register_memory.address;
 			c->registers[r1] = vread64(c, addr);
 			break;
 		case RI:
-			r1 = inst.register_imm.reg1;
-			c->registers[r1] = inst.register_imm.imm64;
+			r1 = inst->register_imm.reg1;
+			c->registers[r1] = inst->register_imm.imm64;
 			break;
 		default:
 			break;
@@ -111,15 +252,15 @@ bool cpu_step(struct core *c) {
 		break;
 
 	case STR:
-		switch (inst.type) {
+		switch (inst->type) {
 		case RR:
-			r1 = inst.register_register.reg1;
-			r2 = inst.register_register.reg2;
+			r1 = inst->register_register.reg1;
+			r2 = inst->register_register.reg2;
 			vwrite64(c, c->registers[r1], c->registers[r2]);
 			break;
 		case RI:
-			r1 = inst.register_imm.reg1;
-			vwrite64(c, inst.register_imm.imm64, c->registers[r1]);
+			r1 = inst->register_imm.reg1;
+			vwrite64(c, inst->register_imm.imm64, c->registers[r1]);
 			break;
 		default:
 			break;
@@ -130,85 +271,72 @@ bool cpu_step(struct core *c) {
 	case SUB:
 	case MUL:
 	case DIV:
-		if (inst.opcode == DIV && inst.type == RR &&
-			inst.register_register.reg2 != 0) {
+		if (inst->opcode == DIV && inst->type == RR &&
+			inst->register_register.reg2 != 0) {
 			/* fall through */
 		}
-		if ((inst.opcode == DIV) && (inst.type == RR &&
-			 c->registers[inst.register_register.reg2] == 0)) {
+		if ((inst->opcode == DIV) && (inst->type == RR &&
+			 c->registers[inst->register_register.reg2] == 0)) {
 			irc_raise_interrupt(c->irc, ICR_DIV_BY_ZERO);
 			return true;
 		}
-		if (inst.type == RR) {
-			r1 = inst.register_register.reg1;
+		if (inst->type == RR) {
+			r1 = inst->register_register.reg1;
 			a = c->registers[r1];
-			b = inst.register_register.reg2 == 2 /* DIV? */
-					? c->registers[inst.register_register.reg2]
-					: c->registers[inst.register_register.reg2];
+			b = inst->register_register.reg2 == 2 /* DIV? */
+					? c->registers[inst->register_register.reg2]
+					: c->registers[inst->register_register.reg2];
 		} else {
-			r1 = inst.register_imm.reg1;
+			r1 = inst->register_imm.reg1;
 			a = c->registers[r1];
-			b = inst.register_imm.imm64;
+			b = inst->register_imm.imm64;
 		}
-		switch (inst.opcode) {
+		switch (inst->opcode) {
 		case ADD:
-			res = a + b;
-			update_arith_flags(
-				c, res, a, b,
-				/* carry*/ (res < a),
-				/* overflow*/
-				(((int64_t)a > 0 && (int64_t)b > 0 && (int64_t)res < 0) ||
-				 ((int64_t)a < 0 && (int64_t)b < 0 && (int64_t)res > 0)));
-			c->registers[r1] = res;
+			c->registers[r1] = alu_add(c, a, b);
 			break;
 		case SUB:
-			res = a - b;
-			update_arith_flags(
-				c, res, a, b,
-				/* borrow*/ (a < b),
-				/* overflow*/
-				(((int64_t)a > 0 && (int64_t)b < 0 && (int64_t)res < 0) ||
-				 ((int64_t)a < 0 && (int64_t)b > 0 && (int64_t)res > 0)));
-			c->registers[r1] = res;
+			c->registers[r1] = alu_sub(c, a, b);
 			break;
 		case MUL:
-			res = a * b;
-			update_arith_flags(c, res, a, b, (b != 0 && res / b != a), false);
-			c->registers[r1] = res;
+			c->registers[r1] = alu_mul(c, a, b);
 			break;
 		case DIV:
-			if (inst.type == RI && b == 0) {
+			if (inst->type == RI && b == 0) {
 				irc_raise_interrupt(c->irc, ICR_DIV_BY_ZERO);
 				return true;
 			}
 			c->registers[r1] = a / b;
-			c->registers[FR] &= ~(FLAG_CF | FLAG_OF | FLAG_ZF | FLAG_SF);
+			clear_flags(c);
 			break;
 		default:
 			break;
 		}
+		/* FR as the destination holds the result, not the flags of it */
+		if (r1 == FR)
+			c->flags.op = FLAGS_NONE;
 		break;
 
 	case OR:
 	case AND:
 	case XOR:
 	case NOT: {
-		bool is_not = (inst.opcode == NOT);
-		if ((inst.type != RR && inst.type != RI) ||
-			(is_not && inst.type != RR && inst.type != RI)) {
+		bool is_not = (inst->opcode == NOT);
+		if ((inst->type != RR && inst->type != RI) ||
+			(is_not && inst->type != RR && inst->type != RI)) {
 			irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
 			return true;
 		}
-		if (inst.type == RR) {
-			r1 = inst.register_register.reg1;
+		if (inst->type == RR) {
+			r1 = inst->register_register.reg1;
 			a = c->registers[r1];
-			b = is_not ? 0 : c->registers[inst.register_register.reg2];
+			b = is_not ? 0 : c->registers[inst->register_register.reg2];
 		} else {
-			r1 = inst.register_imm.reg1;
+			r1 = inst->register_imm.reg1;
 			a = c->registers[r1];
-			b = inst.register_imm.imm64;
+			b = inst->register_imm.imm64;
 		}
-		switch (inst.opcode) {
+		switch (inst->opcode) {
 		case OR:
 			res = a | b;
 			break;
@@ -233,10 +361,10 @@ bool cpu_step(struct core *c) {
 	case PUSH:
 		sp = get_sp(c) - 8;
 		set_sp(c, sp);
-		if (inst.one_arg.mode == REGISTER) {
-			vwrite64(c, sp, c->registers[inst.one_arg.reg]);
-		} else if (inst.one_arg.mode == IMM) {
-			vwrite64(c, sp, inst.one_arg.imm64);
+		if (inst->one_arg.mode == REGISTER) {
+			vwrite64(c, sp, c->registers[inst->one_arg.reg]);
+		} else if (inst->one_arg.mode == IMM) {
+			vwrite64(c, sp, inst->one_arg.imm64);
 		} else {
 			irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
 			return true;
@@ -247,8 +375,8 @@ bool cpu_step(struct core *c) {
 		sp = get_sp(c);
 		res = vread64(c, sp);
 		set_sp(c, sp + 8);
-		if (inst.one_arg.mode == REGISTER) {
-			c->registers[inst.one_arg.reg] = res;
+		if (inst->one_arg.mode == REGISTER) {
+			c->registers[inst->one_arg.reg] = res;
 		} else {
 			irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
 			return true;
@@ -260,12 +388,12 @@ bool cpu_step(struct core *c) {
 		set_sp(c, sp);
 		vwrite64(c, sp, next_pc);
 
-		if (inst.one_arg.mode == REGISTER) {
-			c->registers[PC] = c->registers[inst.one_arg.reg];
-		} else if (inst.one_arg.mode == IMM) {
-			c->registers[PC] = inst.one_arg.imm64;
-		} else if (inst.one_arg.mode == ADDRESS) {
-			uint64_t j2 = vread64(c, inst.one_arg.address);
+		if (inst->one_arg.mode == REGISTER) {
+			c->registers[PC] = c->registers[inst->one_arg.reg];
+		} else if (inst->one_arg.mode == IMM) {
+			c->registers[PC] = inst->one_arg.imm64;
+		} else if (inst->one_arg.mode == ADDRESS) {
+			uint64_t j2 = vread64(c, inst->one_arg.address);
 			c->registers[PC] = j2;
 		} else {
 			irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
@@ -280,28 +408,24 @@ bool cpu_step(struct core *c) {
 		return true;
 
 	case CMP: {
-		if (inst.type != RR && inst.type != RI) {
+		if (inst->type != RR && inst->type != RI) {
 			irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
 			return true;
 		}
-		if (inst.type == RR) {
-			a = c->registers[inst.register_register.reg1];
-			b = c->registers[inst.register_register.reg2];
+		if (inst->type == RR) {
+			a = c->registers[inst->register_register.reg1];
+			b = c->registers[inst->register_register.reg2];
 		} else {
-			a = c->registers[inst.register_imm.reg1];
-			b = inst.register_imm.imm64;
+			a = c->registers[inst->register_imm.reg1];
+			b = inst->register_imm.imm64;
 		}
-		res = a - b;
-		update_arith_flags(
-			c, res, a, b, (a < b),
-			(((int64_t)a > 0 && (int64_t)b < 0 && (int64_t)res < 0) ||
-			 ((int64_t)a < 0 && (int64_t)b > 0 && (int64_t)res > 0)));
+		alu_sub(c, a, b);
 		break;
 	}
 
 	case CMOV:
-		if (cond_ok(c, inst.cmove.cond)) {
-			c->registers[inst.cmove.reg1] = c->registers[inst.cmove.reg2];
+		if (cond_ok(c, inst->cmove.cond)) {
+			c->registers[inst->cmove.reg1] = c->registers[inst->cmove.reg2];
 		}
 		break;
 
@@ -338,9 +462,9 @@ bool cpu_step(struct core *c) {
 		return false;
 
 	case COANDSW:
-		addr = inst.register_memory.address;
+		addr = inst->register_memory.address;
 		a = vread64(c, addr);
-		b = inst.register_register.reg1;
+		b = inst->register_register.reg1;
 		if (a == b)
 			vwrite64(c, addr, c->registers[R0]);
 		c->registers[R0] = a;
@@ -353,3 +477,465 @@ bool cpu_step(struct core *c) {
 
 	return true;
 }
+
+bool cpu_exec_inst(struct core *c, const struct block_inst *bi, uint64_t pc) {
+	if (bi->handler == H_SYNC_FLAGS)
+		cpu_sync_flags(c);
+	bool running = cpu_execute(c, &bi->inst, pc, pc + bi->len);
+	if (bi->dest == PPTR)
+		tlb_pptr_written(c);
+	return running;
+}
+
+bool cpu_step(struct core *c) {
+	uint64_t old_pc = c->registers[PC];
+	const struct block_inst *bi = bcache_fetch(c, old_pc);
+	if (bi == nullptr)
+		return true;
+	return cpu_exec_inst(c, bi, old_pc);
+}
+
+bool cpu_cond_ok(struct core *c, uint8_t cond) {
+	return cond_ok(c, (enum cmove_argument_mode)cond);
+}
+
+uint8_t cpu_resolve_handler(const struct instruction *inst) {
+	const bool rr = inst->type == RR;
+
+	if (uses_fr(inst))
+		return H_SYNC_FLAGS;
+	switch (inst->opcode) {
+	case MOV:
+		if (inst->type == RM)
+			return H_MOV_RM;
+		return rr ? H_MOV_RR : H_MOV_RI;
+	case STR:
+		return rr ? H_STR_RR : H_STR_RI;
+	case ADD:
+		return rr ? H_ADD_RR : H_ADD_RI;
+	case SUB:
+		return rr ? H_SUB_RR : H_SUB_RI;
+	case MUL:
+		return rr ? H_MUL_RR : H_MUL_RI;
+	case DIV:
+		return rr ? H_DIV_RR : H_DIV_RI;
+	case OR:
+		return rr ? H_OR_RR : H_OR_RI;
+	case AND:
+		return rr ? H_AND_RR : H_AND_RI;
+	case XOR:
+		return rr ? H_XOR_RR : H_XOR_RI;
+	case NOT:
+		return rr ? H_NOT_RR : H_NOT_RI;
+	case PUSH:
+		if (inst->one_arg.mode == REGISTER)
+			return H_PUSH_R;
+		return inst->one_arg.mode == IMM ? H_PUSH_I : H_GENERIC;
+	case POP:
+		return inst->one_arg.mode == REGISTER ? H_POP_R : H_GENERIC;
+	case CALL:
+		if (inst->one_arg.mode == REGISTER)
+			return H_CALL_R;
+		return inst->one_arg.mode == IMM ? H_CALL_I : H_CALL_A;
+	case CMP:
+		return rr ? H_CMP_RR : H_CMP_RI;
+	case CMOV:
+		return H_CMOV;
+	default:
+		return H_GENERIC;
+	}
+}
+
+static bool is_branch_tail(const struct block_inst *bi) {
+	const struct instruction *mov = &bi[0].inst, *cmov = &bi[1].inst;
+	if (mov->opcode != MOV || mov->type != RI ||
+		mov->register_imm.reg1 >= PC || cmov->opcode != CMOV)
+		return false;
+	return cmov->cmove.reg1 == PC && cmov->cmove.reg2 == mov->register_imm.reg1;
+}
+
+void cpu_fuse_block(struct block *b) {
+	/* the cmov writes PC, so the sequence can only end the block */
+	if (b->count < 3 || !is_branch_tail(&b->insts[b->count - 2]))
+		return;
+	struct block_inst *bi = &b->insts[b->count - 3];
+	if (bi->handler == H_CMP_RR)
+		bi->handler = H_BRANCH_RR;
+	else if (bi->handler == H_CMP_RI)
+		bi->handler = H_BRANCH_RI;
+}
+
+uint64_t cpu_step_block(struct core *c, uint64_t left, bool *running) {
+	static const void *const handlers[H_COUNT] = {
+		[H_GENERIC] = &&h_generic,
+		[H_SYNC_FLAGS] = &&h_sync_flags,
+		[H_MOV_RR] = &&h_mov_rr,
+		[H_MOV_RM] = &&h_mov_rm,
+		[H_MOV_RI] = &&h_mov_ri,
+		[H_STR_RR] = &&h_str_rr,
+		[H_STR_RI] = &&h_str_ri,
+		[H_ADD_RR] = &&h_add_rr,
+		[H_ADD_RI] = &&h_add_ri,
+		[H_SUB_RR] = &&h_sub_rr,
+		[H_SUB_RI] = &&h_sub_ri,
+		[H_MUL_RR] = &&h_mul_rr,
+		[H_MUL_RI] = &&h_mul_ri,
+		[H_DIV_RR] = &&h_div_rr,
+		[H_DIV_RI] = &&h_div_ri,
+		[H_OR_RR] = &&h_or_rr,
+		[H_OR_RI] = &&h_or_ri,
+		[H_AND_RR] = &&h_and_rr,
+		[H_AND_RI] = &&h_and_ri,
+		[H_XOR_RR] = &&h_xor_rr,
+		[H_XOR_RI] = &&h_xor_ri,
+		[H_NOT_RR] = &&h_not_rr,
+		[H_NOT_RI] = &&h_not_ri,
+		[H_PUSH_R] = &&h_push_r,
+		[H_PUSH_I] = &&h_push_i,
+		[H_POP_R] = &&h_pop_r,
+		[H_CALL_R] = &&h_call_r,
+		[H_CALL_I] = &&h_call_i,
+		[H_CALL_A] = &&h_call_a,
+		[H_CMP_RR] = &&h_cmp_rr,
+		[H_CMP_RI] = &&h_cmp_ri,
+		[H_CMOV] = &&h_cmov,
+		[H_BRANCH_RR] = &&h_branch_rr,
+		[H_BRANCH_RI] = &&h_branch_ri,
+	};
+
+	struct bcache *bc = c->bcache;
+	uint64_t *reg = c->registers;
+	uint64_t pc = reg[PC];
+
+	*running = true;
+	const struct block *blk = bcache_lookup(c, pc);
+	if (blk == nullptr)
+		return 1;
+
+	const struct block_inst *bi = blk->insts;
+	const struct block_inst *last = blk->insts + blk->count - 1;
+	const struct instruction *inst;
+	uint64_t next, res, sp;
+	uint64_t executed = 0;
+
+	/* a store that invalidates this block clears the cursor */
+	bc->cur = (struct block *)blk;
+
+#define DISPATCH()                                                             \
+	do {                                                                       \
+		inst = &bi->inst;                                                      \
+		next = pc + bi->len;                                                   \
+		reg[PC] = next;                                                        \
+		executed++;                                                            \
+		goto *handlers[bi->handler];                                           \
+	} while (0)
+#define NEXT()                                                                 \
+	do {                                                                       \
+		if (bi == last || executed == left)                                    \
+			goto out;                                                          \
+		pc = next;                                                             \
+		bi++;                                                                  \
+		DISPATCH();                                                            \
+	} while (0)
+/* memory accesses can fault, which redirects PC, stores can invalidate the
+ * block we are running from and devices can ask cpu_run() to stop */
+#define NEXT_MEM()                                                             \
+	do {                                                                       \
+		if (reg[PC] != next || bc->cur != blk || cpu_pending(c))               \
+			goto out;                                                          \
+		NEXT();                                                                \
+	} while (0)
+#define RR1 reg[inst->register_register.reg1]
+#define RR2 reg[inst->register_register.reg2]
+#define RI1 reg[inst->register_imm.reg1]
+#define IMM inst->register_imm.imm64
+
+	DISPATCH();
+
+h_sync_flags:
+	cpu_sync_flags(c);
+h_generic:
+	if (!cpu_execute(c, inst, pc, next)) {
+		*running = false;
+		goto out;
+	}
+	NEXT_MEM();
+
+h_mov_rr:
+	RR1 = RR2;
+	NEXT();
+h_mov_rm:
+	reg[inst->register_memory.reg1] = vread64(c, inst->register_memory.address);
+	NEXT_MEM();
+h_mov_ri:
+	RI1 = IMM;
+	NEXT();
+
+h_str_rr:
+	vwrite64(c, RR1, RR2);
+	NEXT_MEM();
+h_str_ri:
+	vwrite64(c, IMM, RI1);
+	NEXT_MEM();
+
+h_add_rr:
+	RR1 = alu_add(c, RR1, RR2);
+	NEXT();
+h_add_ri:
+	RI1 = alu_add(c, RI1, IMM);
+	NEXT();
+h_sub_rr:
+	RR1 = alu_sub(c, RR1, RR2);
+	NEXT();
+h_sub_ri:
+	RI1 = alu_sub(c, RI1, IMM);
+	NEXT();
+h_mul_rr:
+	RR1 = alu_mul(c, RR1, RR2);
+	NEXT();
+h_mul_ri:
+	RI1 = alu_mul(c, RI1, IMM);
+	NEXT();
+
+h_div_rr:
+	if (RR2 == 0) {
+		irc_raise_interrupt(c->irc, ICR_DIV_BY_ZERO);
+		goto out;
+	}
+	RR1 = RR1 / RR2;
+	clear_flags(c);
+	NEXT();
+h_div_ri:
+	if (IMM == 0) {
+		irc_raise_interrupt(c->irc, ICR_DIV_BY_ZERO);
+		goto out;
+	}
+	RI1 = RI1 / IMM;
+	clear_flags(c);
+	NEXT();
+
+h_or_rr:
+	res = RR1 = RR1 | RR2;
+	update_logic_flags(c, res);
+	NEXT();
+h_or_ri:
+	res = RI1 = RI1 | IMM;
+	update_logic_flags(c, res);
+	NEXT();
+h_and_rr:
+	res = RR1 = RR1 & RR2;
+	update_logic_flags(c, res);
+	NEXT();
+h_and_ri:
+	res = RI1 = RI1 & IMM;
+	update_logic_flags(c, res);
+	NEXT();
+h_xor_rr:
+	res = RR1 = RR1 ^ RR2;
+	update_logic_flags(c, res);
+	NEXT();
+h_xor_ri:
+	res = RI1 = RI1 ^ IMM;
+	update_logic_flags(c, res);
+	NEXT();
+h_not_rr:
+	res = RR1 = ~RR1;
+	update_logic_flags(c, res);
+	NEXT();
+h_not_ri:
+	res = RI1 = ~RI1;
+	update_logic_flags(c, res);
+	NEXT();
+
+h_push_r:
+	sp = get_sp(c) - 8;
+	set_sp(c, sp);
+	vwrite64(c, sp, reg[inst->one_arg.reg]);
+	NEXT_MEM();
+h_push_i:
+	sp = get_sp(c) - 8;
+	set_sp(c, sp);
+	vwrite64(c, sp, inst->one_arg.imm64);
+	NEXT_MEM();
+h_pop_r:
+	sp = get_sp(c);
+	res = vread64(c, sp);
+	set_sp(c, sp + 8);
+	reg[inst->one_arg.reg] = res;
+	NEXT_MEM();
+
+h_call_r:
+	sp = get_sp(c) - 8;
+	set_sp(c, sp);
+	vwrite64(c, sp, next);
+	reg[PC] = reg[inst->one_arg.reg];
+	goto out;
+h_call_i:
+	sp = get_sp(c) - 8;
+	set_sp(c, sp);
+	vwrite64(c, sp, next);
+	reg[PC] = inst->one_arg.imm64;
+	goto out;
+h_call_a:
+	sp = get_sp(c) - 8;
+	set_sp(c, sp);
+	vwrite64(c, sp, next);
+	reg[PC] = vread64(c, inst->one_arg.address);
+	goto out;
+
+h_cmp_rr:
+	alu_sub(c, RR1, RR2);
+	NEXT();
+h_cmp_ri:
+	alu_sub(c, RI1, IMM);
+	NEXT();
+
+h_cmov:
+	if (cond_ok(c, inst->cmove.cond))
+		reg[inst->cmove.reg1] = reg[inst->cmove.reg2];
+	NEXT();
+
+/* the fused sequence only runs whole, not past the end of the budget */
+h_branch_rr:
+	if (left - executed < 2)
+		goto h_cmp_rr;
+	alu_sub(c, RR1, RR2);
+	goto branch;
+h_branch_ri:
+	if (left - executed < 2)
+		goto h_cmp_ri;
+	alu_sub(c, RI1, IMM);
+branch:
+	/* the scratch register stays guest visible */
+	reg[bi[1].inst.register_imm.reg1] = bi[1].inst.register_imm.imm64;
+	if (cond_ok(c, bi[2].inst.cmove.cond))
+		reg[PC] = bi[1].inst.register_imm.imm64;
+	else
+		reg[PC] = next + bi[1].len + bi[2].len;
+	executed += 2;
+	bi += 2;
+	goto out;
+
+#undef DISPATCH
+#undef NEXT
+#undef NEXT_MEM
+#undef RR1
+#undef RR2
+#undef RI1
+#undef IMM
+
+out:
+	bc->cur = nullptr;
+	if (bi->dest == PPTR)
+		tlb_pptr_written(c);
+	return executed;
+}
+
+static bool at_breakpoint(struct core *c) {
+	for (uint8_t i = 0; i < c->nbreakpoints; i++)
+		if (c->breakpoints[i] == c->registers[PC])
+			return true;
+	return false;
+}
+
+bool cpu_toggle_breakpoint(struct core *c, uint64_t addr) {
+	for (uint8_t i = 0; i < c->nbreakpoints; i++) {
+		if (c->breakpoints[i] == addr) {
+			c->breakpoints[i] = c->breakpoints[--c->nbreakpoints];
+			return false;
+		}
+	}
+	if (c->nbreakpoints == CPU_MAX_BREAKPOINTS)
+		return false;
+	c->breakpoints[c->nbreakpoints++] = addr;
+	return true;
+}
+
+void cpu_post_work(struct core *c, struct cpu_work *w) {
+	if (atomic_exchange_explicit(&w->queued, true, memory_order_acq_rel))
+		return;
+	w->next = atomic_load_explicit(&c->posted_work, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(&c->posted_work, &w->next, w,
+												  memory_order_release,
+												  memory_order_relaxed))
+		;
+	cpu_request(c, CPU_REQ_IRQ);
+}
+
+void cpu_run_posted(struct core *c) {
+	struct cpu_work *w =
+		atomic_exchange_explicit(&c->posted_work, nullptr, memory_order_acquire);
+	while (w != nullptr) {
+		struct cpu_work *next = w->next;
+		/* posting again from here on queues it for the next round */
+		atomic_store_explicit(&w->queued, false, memory_order_release);
+		w->fn(c);
+		w = next;
+	}
+
+	uint64_t irqs =
+		atomic_exchange_explicit(&c->posted_irqs, 0, memory_order_acquire);
+	while (irqs != 0) {
+		irc_raise_interrupt(c->irc, __builtin_ctzll(irqs));
+		irqs &= irqs - 1;
+	}
+}
+
+enum cpu_exit cpu_run(struct core *c, uint64_t budget) {
+	enum cpu_exit why = CPU_EXIT_BUDGET;
+	const uint64_t start = c->retired;
+	bool running = true;
+
+	/* retired is kept current so events see the time of their block */
+	while (c->retired - start < budget) {
+		if (c->retired >= c->deadline)
+			event_run_due(c);
+
+		/* every instruction is a boundary. the breakpoint that stopped the
+		 * last run is run over once, unless PC moved away meanwhile */
+		if (c->nbreakpoints != 0) {
+			if (c->bp_resume && c->registers[PC] != c->bp_pc)
+				c->bp_resume = false;
+			if (!c->bp_resume && at_breakpoint(c)) {
+				c->bp_resume = true;
+				c->bp_pc = c->registers[PC];
+				why = CPU_EXIT_BREAKPOINT;
+				break;
+			}
+		}
+
+		uint32_t req = atomic_load_explicit(&c->requests, memory_order_relaxed);
+		if (req != 0) {
+			why = req == CPU_REQ_IRQ ? CPU_EXIT_IRQ : CPU_EXIT_PAUSE;
+			break;
+		}
+
+		uint64_t left = budget - (c->retired - start);
+		if (c->deadline - c->retired < left)
+			left = c->deadline - c->retired;
+		uint64_t done = 0;
+		if (c->nbreakpoints != 0) {
+			running = cpu_step(c);
+			c->bp_resume = false;
+			done = 1;
+		} else if (c->engine == ENGINE_JIT) {
+			done = jit_run(c, left, &running);
+		} else if (c->engine == ENGINE_THREADED) {
+			done = cpu_step_block(c, left, &running);
+		} else {
+			do {
+				running = cpu_step(c);
+				done++;
+			} while (running && done < left &&
+					 !bcache_at_boundary(c->bcache) && !cpu_pending(c));
+		}
+		c->retired += done;
+
+		if (!running) {
+			why = CPU_EXIT_HALT;
+			break;
+		}
+	}
+
+	return why;
+}
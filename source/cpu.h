@@ -1,6 +1,7 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include <stdatomic.h>
 #include <stdint.h>
 
 enum registers_id : uint8_t {
@@ -54,17 +55,212 @@ enum registers_id : uint8_t {
 #define FLAG_LF (1ULL << 4)
 #define FLAG_GF (1ULL << 5)
 
+#define TLB_ENTRIES 64
+#define TLB_INVALID (~0ULL)
+
+/* the low bits of PPTR name the address space, the table sits above them.
+ * writing PPTR drops the cached translations of the new ASID unless
+ * PPTR_KEEP is set, which reads back as 0 */
+#define PPTR_ASID 0xFFULL
+#define PPTR_KEEP (1ULL << 63)
+
+enum tlb_access : uint8_t {
+	TLB_READ,
+	TLB_WRITE,
+	TLB_EXEC,
+	TLB_KINDS,
+};
+
+struct tlb_entry {
+	uint64_t vpage; /* tlb_tag(), TLB_INVALID when empty */
+	uintptr_t ppage;
+	uint8_t *host; /* guest RAM backing the page, nullptr for MMIO */
+	/* permissions ANDed over every level of the walk */
+	bool usermode;
+	bool write;
+	bool execute;
+};
+
+#define TLB_LARGE_ENTRIES 8
+#define PSC_ENTRIES 16
+
+/* a large page from the walk, 4 KiB entries for it are filled from here
+ * without walking again */
+struct tlb_large {
+	uint64_t tag; /* tlb_tag(vaddr >> shift), TLB_INVALID when empty */
+	uintptr_t pbase;
+	uint8_t shift; /* 25 or 38 */
+	bool usermode;
+	bool write;
+	bool execute;
+};
+
+/* paging-structure cache, the last level table for vaddr >> 25 so a TLB miss
+ * only reads one entry */
+struct psc_entry {
+	uint64_t tag; /* tlb_tag(vaddr >> 25), TLB_INVALID when empty */
+	uintptr_t table;
+	uintptr_t pages[3]; /* frames holding the upper level entries */
+	bool usermode;
+	bool write;
+	bool execute;
+};
+
+/* direct mapped, one array per access kind. entries of every address space
+ * share the arrays, tagged with their ASID */
+struct tlb {
+	uint64_t asid; /* PPTR & PPTR_ASID */
+	struct tlb_entry entries[TLB_KINDS][TLB_ENTRIES];
+	struct tlb_large large[TLB_LARGE_ENTRIES]; /* fully associative */
+	uint8_t large_next;						   /* round robin victim */
+	struct psc_entry psc[PSC_ENTRIES];
+	/* bit (frame & 63) for every frame in psc[].pages, stores to those have
+	 * no host pointer so they can drop the cache */
+	uint64_t psc_watch;
+	/* bumped by every PPTR write and full flush, anything caching
+	 * translations of its own drops them when it moves */
+	uint64_t flushes;
+	uint64_t hits;
+	uint64_t misses;
+};
+
+enum cpu_engine : uint8_t {
+	ENGINE_SWITCH,	 /* cpu_step(), one instruction per call */
+	ENGINE_THREADED, /* cpu_step_block(), computed goto through a block */
+	ENGINE_JIT,		 /* jit_run(), blocks translated to host code */
+};
+
+/* operation that last produced CF/OF/ZF/SF, the bits in FR are stale until
+ * cpu_sync_flags() folds it in */
+enum flags_op : uint8_t {
+	FLAGS_NONE,
+	FLAGS_ADD,
+	FLAGS_SUB,
+	FLAGS_MUL,
+	FLAGS_LOGIC, /* ZF/SF only, CF/OF stay what FR holds */
+};
+
+struct lazy_flags {
+	uint64_t res;
+	uint64_t a;
+	uint64_t b;
+	enum flags_op op;
+};
+
+#define CPU_MAX_BREAKPOINTS 8
+
+/* raised from other threads, cpu_run() notices them at the next block
+ * boundary. a device raising one from inside a store stops the run right
+ * after that instruction */
+enum cpu_request : uint32_t {
+	CPU_REQ_IRQ = 1u << 0, /* cpu_post_irq() or cpu_post_work() was called */
+	CPU_REQ_PAUSE = 1u << 1,
+	CPU_REQ_SAVE = 1u << 2, /* snapshot the machine */
+	CPU_REQ_RESTORE = 1u << 3,
+};
+
+enum cpu_exit : uint8_t {
+	CPU_EXIT_BUDGET,
+	CPU_EXIT_HALT,
+	CPU_EXIT_IRQ,
+	CPU_EXIT_BREAKPOINT,
+	CPU_EXIT_PAUSE, /* any request other than CPU_REQ_IRQ */
+};
+
 struct irc;
+struct bcache;
+struct jit;
+struct instruction;
+struct block_inst;
+struct block;
 
 struct core {
 	uint64_t registers[41];
 	struct irc *irc;
 	struct ram *mem;
-	// optional TODO tlb
+	struct bcache *bcache;
+	struct jit *jit;
+	struct tlb tlb;
+	struct lazy_flags flags;
+	enum cpu_engine engine;
+
+	atomic_uint requests;		  /* enum cpu_request bits */
+	_Atomic uint64_t posted_irqs; /* bit per vector, see cpu_post_irq() */
+	struct cpu_work *_Atomic posted_work;
+	uint64_t retired;  /* instructions run by cpu_run() */
+	uint64_t deadline; /* retired count of the next event, see events.h */
+	/* only changed while cpu_run() isn't running */
+	uint64_t breakpoints[CPU_MAX_BREAKPOINTS];
+	uint8_t nbreakpoints;
+	bool bp_resume; /* stopped at bp_pc, run over it once */
+	uint64_t bp_pc;
 };
 
-void cpu_init(struct core *c, struct ram *mem);
+/* false if the interrupt controller or the block cache can't be allocated */
+bool cpu_init(struct core *c, struct ram *mem);
+
+/* brings registers[FR] up to date, call before reading it from outside the
+ * instruction handlers */
+uint64_t cpu_sync_flags(struct core *c);
 
 bool cpu_step(struct core *c);
 
+/* executes one decoded instruction at pc, false on HLT */
+bool cpu_exec_inst(struct core *c, const struct block_inst *bi, uint64_t pc);
+
+/* evaluates a CMOV condition against the current flags */
+bool cpu_cond_ok(struct core *c, uint8_t cond);
+
+/* picks the threaded handler for a decoded instruction */
+uint8_t cpu_resolve_handler(const struct instruction *inst);
+
+/* replaces handlers of instruction sequences that have a combined one */
+void cpu_fuse_block(struct block *b);
+
+/* runs the rest of the block at PC but at most left instructions, returns the
+ * number executed and clears *running on HLT */
+uint64_t cpu_step_block(struct core *c, uint64_t left, bool *running);
+
+/* runs up to budget instructions with the selected engine, requests,
+ * breakpoints and the event deadline are checked between blocks */
+enum cpu_exit cpu_run(struct core *c, uint64_t budget);
+
+/* returns true if addr is a breakpoint afterwards */
+bool cpu_toggle_breakpoint(struct core *c, uint64_t addr);
+
+static inline void cpu_request(struct core *c, uint32_t req) {
+	atomic_fetch_or_explicit(&c->requests, req, memory_order_release);
+}
+
+static inline bool cpu_pending(struct core *c) {
+	return atomic_load_explicit(&c->requests, memory_order_relaxed) != 0;
+}
+
+static inline uint32_t cpu_take_requests(struct core *c) {
+	return atomic_exchange_explicit(&c->requests, 0, memory_order_acquire);
+}
+
+/* device threads can't touch the IRC, and guest RAM only through buffers the
+ * guest handed them (see struct ram). they post the vector (below 64) or the
+ * work, and the CPU thread gets to it in cpu_run_posted() after CPU_REQ_IRQ.
+ * completing a request belongs in that work */
+static inline void cpu_post_irq(struct core *c, uint16_t vector) {
+	atomic_fetch_or_explicit(&c->posted_irqs, 1ull << vector,
+							 memory_order_relaxed);
+	cpu_request(c, CPU_REQ_IRQ);
+}
+
+/* something a device thread needs done on the CPU thread, queued at most
+ * once until fn runs */
+struct cpu_work {
+	void (*fn)(struct core *c);
+	atomic_bool queued;
+	struct cpu_work *next;
+};
+
+void cpu_post_work(struct core *c, struct cpu_work *w);
+
+/* runs the posted work, then raises the posted interrupts */
+void cpu_run_posted(struct core *c);
+
 #endif // CPU_H
@@ -0,0 +1,115 @@
+#include <cpu.h>
+#include <display.h>
+#include <mmio.h>
+#include <paging.h>
+#include <snapshot.h>
+#include <string.h>
+
+#define DISPLAY_NONE (~0ull)
+
+/* written by the CPU thread, the UI thread takes flips and counts vsyncs */
+static struct {
+	_Atomic uint64_t front;
+	_Atomic uint64_t next; /* DISPLAY_NONE unless a flip is pending */
+	_Atomic uint64_t ctrl;
+	_Atomic uint64_t frames;
+	_Atomic uint64_t bad;
+} regs;
+
+static size_t frame_size;
+
+static const uint8_t *frame_host(struct core *c, uintptr_t paddr) {
+	return phys_dma_map(c, paddr, frame_size);
+}
+
+static bool display_read(struct core *, uintptr_t offset, void *buf,
+						 size_t len) {
+	memset(buf, 0, len);
+	if (len != 8)
+		return true;
+	uint64_t v = 0;
+	if (offset == DISPLAY_REG_FLIP) {
+		v = atomic_load_explicit(&regs.front, memory_order_relaxed);
+	} else if (offset == DISPLAY_REG_STATUS) {
+		if (atomic_load_explicit(&regs.next, memory_order_relaxed) !=
+			DISPLAY_NONE)
+			v |= DISPLAY_STATUS_PENDING;
+		if (atomic_load_explicit(&regs.bad, memory_order_relaxed))
+			v |= DISPLAY_STATUS_BAD;
+	} else if (offset == DISPLAY_REG_CTRL) {
+		v = atomic_load_explicit(&regs.ctrl, memory_order_relaxed);
+	} else if (offset == DISPLAY_REG_FRAMES) {
+		v = atomic_load_explicit(&regs.frames, memory_order_relaxed);
+	}
+	memcpy(buf, &v, sizeof v);
+	return true;
+}
+
+static bool display_write(struct core *c, uintptr_t offset, const void *buf,
+						  size_t len) {
+	if (len != 8)
+		return true;
+	uint64_t v;
+	memcpy(&v, buf, sizeof v);
+	if (offset == DISPLAY_REG_FLIP) {
+		const bool ok = frame_host(c, v) != nullptr;
+		atomic_store_explicit(&regs.bad, !ok, memory_order_relaxed);
+		/* the frame's pixels have to be visible before the flip is */
+		if (ok)
+			atomic_store_explicit(&regs.next, v, memory_order_release);
+	} else if (offset == DISPLAY_REG_CTRL) {
+		atomic_store_explicit(&regs.ctrl, v, memory_order_relaxed);
+	}
+	return true;
+}
+
+bool display_init(size_t size) {
+	static struct mmio_hook hook = {
+		.base = DISPLAY_BASE,
+		.size = DISPLAY_SIZE,
+		.read = display_read,
+		.write = display_write,
+		.next = nullptr,
+	};
+	static struct snapshot_dev dev = {
+		.name = "display",
+		.data = &regs,
+		.size = sizeof regs,
+	};
+	frame_size = size;
+	regs.front = DISPLAY_NONE;
+	regs.next = DISPLAY_NONE;
+	if (!register_mmio_hook(&hook))
+		return false;
+	snapshot_register(&dev);
+	return true;
+}
+
+bool display_vsync(struct core *c, bool running, const uint8_t **frame) {
+	if (running) {
+		atomic_fetch_add_explicit(&regs.frames, 1, memory_order_relaxed);
+		if (atomic_load_explicit(&regs.ctrl, memory_order_relaxed) &
+			DISPLAY_CTRL_VSYNC_IRQ)
+			cpu_post_irq(c, ICR_VSYNC);
+	}
+
+	*frame = nullptr;
+	const uint64_t next =
+		atomic_exchange_explicit(&regs.next, DISPLAY_NONE, memory_order_acquire);
+	if (next != DISPLAY_NONE) {
+		atomic_store_explicit(&regs.front, next, memory_order_relaxed);
+		*frame = frame_host(c, next);
+	}
+	return atomic_load_explicit(&regs.front, memory_order_relaxed) !=
+		   DISPLAY_NONE;
+}
+
+void display_reshow(void) {
+	uint64_t none = DISPLAY_NONE;
+	const uint64_t front =
+		atomic_load_explicit(&regs.front, memory_order_relaxed);
+	if (front != DISPLAY_NONE)
+		atomic_compare_exchange_strong_explicit(&regs.next, &none, front,
+												memory_order_release,
+												memory_order_relaxed);
+}
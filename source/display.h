@@ -0,0 +1,42 @@
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct core;
+
+/* display controller. the guest draws into any number of frames in RAM or in
+ * the legacy framebuffer and writes the physical address of a finished one to
+ * DISPLAY_REG_FLIP. it is shown from the next vsync on, which clears
+ * DISPLAY_STATUS_PENDING, and is only read by the host then. a frame must be
+ * left alone while it is pending or shown. until the first flip the legacy
+ * framebuffer is shown as it is drawn */
+#define DISPLAY_BASE 0x90220000UL
+#define DISPLAY_SIZE 0x20
+
+/* guest visible registers, all 8 bytes wide */
+#define DISPLAY_REG_FLIP 0x00	/* W: next frame, R: the one shown or ~0 */
+#define DISPLAY_REG_STATUS 0x08 /* R: DISPLAY_STATUS_* */
+#define DISPLAY_REG_CTRL 0x10	/* RW: DISPLAY_CTRL_* */
+#define DISPLAY_REG_FRAMES 0x18 /* R: vsyncs so far */
+
+#define DISPLAY_STATUS_PENDING (1u << 0) /* flipped, not shown yet */
+#define DISPLAY_STATUS_BAD (1u << 1)	 /* last flip wasn't a whole frame */
+#define DISPLAY_CTRL_VSYNC_IRQ (1u << 0)
+
+#define ICR_VSYNC 14 /* IRC4 */
+
+/* frame_size bytes per frame, false with errno set if the registers can't be
+ * mapped */
+bool display_init(size_t frame_size);
+
+/* called by the UI once per refresh, the vsync is only counted and
+ * interrupts only while the guest runs. false until the guest has flipped,
+ * after that *frame is the frame flipped to since the last call or nullptr */
+bool display_vsync(struct core *c, bool running, const uint8_t **frame);
+
+/* after a restore, the next vsync hands out the shown frame again */
+void display_reshow(void);
+
+#endif // DISPLAY_H
@@ -0,0 +1,197 @@
+#include <cpu.h>
+#include <events.h>
+#include <pthread.h>
+#include <time.h>
+
+/* a binary min-heap per clock, ordered by when */
+struct heap {
+	struct event *e[EVENT_MAX];
+	uint8_t n;
+};
+
+static struct heap heaps[2];
+
+/* the host clock thread sleeps until host_next and hands the heap back to
+ * the CPU thread, which sets host_next again once it ran what was due */
+static pthread_mutex_t host_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t host_cv;
+static uint64_t host_next = EVENT_NEVER;
+static bool host_started;
+static struct core *host_core;
+
+static uint64_t host_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t event_now(struct core *c, enum event_clock clock) {
+	return clock == EVENT_HOST ? host_ns() : c->retired;
+}
+
+static void heap_set(struct heap *h, uint8_t i, struct event *e) {
+	h->e[i] = e;
+	e->slot = i + 1;
+}
+
+static void sift_up(struct heap *h, uint8_t i) {
+	struct event *e = h->e[i];
+	while (i > 0 && h->e[(i - 1) / 2]->when > e->when) {
+		heap_set(h, i, h->e[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	heap_set(h, i, e);
+}
+
+static void sift_down(struct heap *h, uint8_t i) {
+	struct event *e = h->e[i];
+	for (;;) {
+		uint8_t child = 2 * i + 1;
+		if (child >= h->n)
+			break;
+		if (child + 1 < h->n && h->e[child + 1]->when < h->e[child]->when)
+			child++;
+		if (h->e[child]->when >= e->when)
+			break;
+		heap_set(h, i, h->e[child]);
+		i = child;
+	}
+	heap_set(h, i, e);
+}
+
+static void heap_remove(struct heap *h, struct event *e) {
+	const uint8_t i = e->slot - 1;
+	e->slot = 0;
+	if (--h->n == i)
+		return;
+	struct event *last = h->e[h->n];
+	heap_set(h, i, last);
+	sift_down(h, i);
+	sift_up(h, last->slot - 1);
+}
+
+static void run_heap(struct core *c, struct heap *h, uint64_t now) {
+	while (h->n != 0 && h->e[0]->when <= now) {
+		struct event *e = h->e[0];
+		heap_remove(h, e);
+		e->fn(c, e);
+	}
+}
+
+static void host_due(struct core *c);
+static struct cpu_work host_work = {.fn = host_due};
+
+static void *host_thread(void *) {
+	pthread_mutex_lock(&host_lock);
+	for (;;) {
+		if (host_next == EVENT_NEVER) {
+			pthread_cond_wait(&host_cv, &host_lock);
+		} else if (host_ns() < host_next) {
+			const struct timespec ts = {
+				.tv_sec = host_next / 1000000000,
+				.tv_nsec = host_next % 1000000000,
+			};
+			pthread_cond_timedwait(&host_cv, &host_lock, &ts);
+		} else {
+			host_next = EVENT_NEVER;
+			cpu_post_work(host_core, &host_work);
+		}
+	}
+	return nullptr;
+}
+
+/* with host_lock held */
+static void host_start(void) {
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&host_cv, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pthread_t t;
+	host_started = pthread_create(&t, nullptr, host_thread, nullptr) == 0;
+	if (host_started)
+		pthread_detach(t);
+}
+
+static void host_update(void) {
+	const struct heap *h = &heaps[EVENT_HOST];
+	pthread_mutex_lock(&host_lock);
+	host_next = h->n != 0 ? h->e[0]->when : EVENT_NEVER;
+	if (host_started)
+		pthread_cond_signal(&host_cv);
+	else if (host_next != EVENT_NEVER)
+		host_start();
+	pthread_mutex_unlock(&host_lock);
+}
+
+static void host_due(struct core *c) {
+	run_heap(c, &heaps[EVENT_HOST], host_ns());
+	host_update();
+}
+
+/* host_lock is held across fork() so the child gets it unlocked. the thread
+ * doesn't survive, event_fork_child() starts the child's own */
+static void before_fork(void) { pthread_mutex_lock(&host_lock); }
+
+static void after_fork_parent(void) { pthread_mutex_unlock(&host_lock); }
+
+static void after_fork_child(void) {
+	host_started = false;
+	pthread_mutex_unlock(&host_lock);
+}
+
+void event_fork_child(struct core *c) {
+	if (host_core == nullptr)
+		return;
+	host_core = c;
+	host_update();
+}
+
+static void insns_update(struct core *c) {
+	const struct heap *h = &heaps[EVENT_INSNS];
+	c->deadline = h->n != 0 ? h->e[0]->when : EVENT_NEVER;
+}
+
+bool event_at(struct core *c, struct event *e, uint64_t when) {
+	struct heap *h = &heaps[e->clock];
+	if (e->slot != 0)
+		heap_remove(h, e);
+	else if (h->n == EVENT_MAX)
+		return false;
+
+	/* not now, so an event queueing itself again can't spin */
+	const uint64_t now = event_now(c, e->clock);
+	e->when = when > now ? when : now + 1;
+	h->e[h->n] = e;
+	sift_up(h, h->n++);
+
+	if (e->clock == EVENT_INSNS) {
+		insns_update(c);
+	} else {
+		static bool registered;
+		if (!registered) {
+			pthread_atfork(before_fork, after_fork_parent,
+						   after_fork_child);
+			registered = true;
+		}
+		host_core = c;
+		host_update();
+	}
+	return true;
+}
+
+void event_cancel(struct core *c, struct event *e) {
+	if (e->slot == 0)
+		return;
+	heap_remove(&heaps[e->clock], e);
+	if (e->clock == EVENT_INSNS)
+		insns_update(c);
+	else
+		host_update();
+}
+
+void event_run_due(struct core *c) {
+	run_heap(c, &heaps[EVENT_INSNS], c->retired);
+	insns_update(c);
+}
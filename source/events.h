@@ -0,0 +1,44 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdint.h>
+
+struct core;
+
+/* things devices want done later, on the CPU thread. cpu_run() keeps the
+ * instruction count of the next one in core.deadline and only calls in here
+ * once it gets there, host clock events are watched by a thread that posts
+ * them as work when they are due. both are noticed at block boundaries, so an
+ * event runs up to a block late */
+#define EVENT_MAX 32 /* queued per clock */
+#define EVENT_NEVER UINT64_MAX
+
+enum event_clock : uint8_t {
+	EVENT_INSNS, /* core.retired, the same every run */
+	EVENT_HOST,	 /* CLOCK_MONOTONIC nanoseconds */
+};
+
+struct event {
+	void (*fn)(struct core *c, struct event *e);
+	uint64_t when;
+	enum event_clock clock;
+	uint8_t slot; /* heap position + 1, 0 while not queued */
+};
+
+uint64_t event_now(struct core *c, enum event_clock clock);
+
+/* (re)queues e to run at when on its clock, a time that has passed means the
+ * next boundary. CPU thread only, fn may queue e again. false if the clock
+ * has EVENT_MAX events queued already */
+bool event_at(struct core *c, struct event *e, uint64_t when);
+void event_cancel(struct core *c, struct event *e);
+
+/* runs the instruction clock events that are due and moves core.deadline on,
+ * called by cpu_run() */
+void event_run_due(struct core *c);
+
+/* a forked child starts without the host clock thread, this brings it back
+ * for the host events it inherited. call it in the child before running */
+void event_fork_child(struct core *c);
+
+#endif // EVENTS_H
@@ -3,308 +3,179 @@
 #include <interrupt.h>
 #include <ncurses.h>
 #include <paging.h>
+#include <string.h>
 
 #define is_valid_reg(r) ((r) <= PPR)
 
-uint64_t parse_instruction(struct core *c, struct instruction *inst,
-						   uint64_t old_pc) {
-	uint8_t header = vread8(c, old_pc);
-	inst->type = header >> 5;
-	inst->opcode = header & 0x1F;
-	uint64_t new_pc = old_pc + 1;
-
+uint8_t inst_dest_reg(const struct instruction *inst) {
 	switch (inst->type) {
-	case NO:
-		switch (inst->opcode) {
-		case RET:
-		case RETI:
-		case SYSRET:
-		case SYSCALL:
-		case HLT:
-			return new_pc;
-		default:
-			irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
-			return 0;
-		}
-
+	case RR:
+		if (inst->opcode == STR || inst->opcode == CMP)
+			return NO_REG;
+		return inst->register_register.reg1;
+	case RM:
+		if (inst->opcode == COANDSW)
+			return R0;
+		return inst->register_memory.reg1;
+	case RI:
+		if (inst->opcode == STR || inst->opcode == CMP)
+			return NO_REG;
+		return inst->register_imm.reg1;
 	case OA:
-		switch (inst->opcode) {
-		case PUSH:
-		case POP:
-		case CALL:
-			break;
-		default:
-			irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
-			return 0;
-		}
-		inst->one_arg.mode = vread8(c, new_pc++);
-		if (inst->one_arg.mode == REGISTER) {
-			inst->one_arg.reg = vread8(c, new_pc++);
-			if (!is_valid_reg(inst->one_arg.reg)) {
-				irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
-				return 0;
-			}
-		} else if (inst->one_arg.mode == ADDRESS) {
-			inst->one_arg.address = vread64(c, new_pc);
-			new_pc += 8;
-		} else if (inst->one_arg.mode == IMM) {
-			inst->one_arg.imm64 = vread64(c, new_pc);
-			new_pc += 8;
-		} else {
-			irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
-			return 0;
-		}
-		return new_pc;
-
-	case RR: {
-		switch (inst->opcode) {
-		case MOV:
-		case ADD:
-		case SUB:
-		case MUL:
-		case DIV:
-		case OR:
-		case AND:
-		case NOT:
-		case XOR:
-		case CMP:
-		case STR:
-			break;
-		default:
-			irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
-			return 0;
-		}
-		uint8_t r1 = vread8(c, new_pc++);
-		uint8_t r2 = vread8(c, new_pc++);
-		if (!is_valid_reg(r1) || !is_valid_reg(r2)) {
-			irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
-			return 0;
-		}
-		inst->register_register.reg1 = r1;
-		inst->register_register.reg2 = r2;
-		return new_pc;
+		if (inst->opcode == POP && inst->one_arg.mode == REGISTER)
+			return inst->one_arg.reg;
+		return NO_REG;
+	case CM:
+		return inst->cmove.reg1;
+	default:
+		return NO_REG;
 	}
+}
 
-	case RM: {
-		switch (inst->opcode) {
-		case MOV:
-		case COANDSW:
-			break;
-		default:
-			irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
-			return 0;
-		}
-		uint8_t r = vread8(c, new_pc++);
-		if (!is_valid_reg(r)) {
-			irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
-			return 0;
-		}
-		inst->register_memory.reg1 = r;
-		inst->register_memory.address = vread64(c, new_pc);
-		new_pc += 8;
-		return new_pc;
-	}
+/* header, mode or register byte and a 64-bit operand */
+#define INST_MAX_LEN 10
 
-	case RI: {
-		switch (inst->opcode) {
-		case MOV:
-		case ADD:
-		case SUB:
-		case MUL:
-		case DIV:
-		case OR:
-		case AND:
-		case NOT:
-		case XOR:
-		case CMP:
-		case STR:
-			break;
-		default:
-			irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
-			return 0;
-		}
-		uint8_t r = vread8(c, new_pc++);
-		if (!is_valid_reg(r)) {
-			irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
-			return 0;
-		}
-		inst->register_imm.reg1 = r;
-		inst->register_imm.imm64 = vread64(c, new_pc);
-		new_pc += 8;
-		return new_pc;
-	}
+/* instruction bytes copied out of guest memory, the first page is fetched up
+ * front and the next one only when the instruction reaches into it */
+struct fetch {
+	uint8_t bytes[INST_MAX_LEN];
+	uint8_t have;
+};
 
-	case CM:
-		if (inst->opcode != CMOV) {
-			irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
-			return 0;
-		}
-		{
-			uint8_t mb = vread8(c, new_pc++);
-			uint8_t cond = mb >> 4;
-			if (cond > GE) {
-				irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
-				return 0;
-			}
-			inst->cmove.cond = (enum cmove_argument_mode)cond;
+static bool fetch_start(struct core *c, struct fetch *f, uint64_t pc) {
+	const size_t room = 0x1000 - (pc & 0xFFF);
+	f->have = room < INST_MAX_LEN ? room : INST_MAX_LEN;
+	return vfetch(c, pc, f->bytes, f->have);
+}
 
-			uint8_t r1 = vread8(c, new_pc++);
-			uint8_t r2 = vread8(c, new_pc++);
-			if (!is_valid_reg(r1) || !is_valid_reg(r2)) {
-				irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
-				return 0;
-			}
-			inst->cmove.reg1 = r1;
-			inst->cmove.reg2 = r2;
-			return new_pc;
-		}
+static bool fetch_need(struct core *c, struct fetch *f, uint64_t pc,
+					   size_t len) {
+	if (len <= f->have)
+		return true;
+	if (!vfetch(c, pc + f->have, f->bytes + f->have, len - f->have))
+		return false;
+	f->have = len;
+	return true;
+}
 
-	default:
-		irc_raise_interrupt(c->irc, ICR_INVALID_OPCODE);
-		return 0;
-	}
+static inline uint64_t fetch64(const struct fetch *f, size_t at) {
+	uint64_t v;
+	memcpy(&v, f->bytes + at, sizeof v);
+	return v;
 }
 
-uint64_t parse_instruction_ro(struct core *c, struct instruction *inst,
-							  uint64_t old_pc) {
-	uint8_t header = vread8(c, old_pc);
+#define HEADER(type, op) ((type) << 5 | (op))
+#define REG_OPS(type, len)                                                     \
+	[HEADER(type, MOV)] = len, [HEADER(type, ADD)] = len,                      \
+	[HEADER(type, SUB)] = len, [HEADER(type, MUL)] = len,                      \
+	[HEADER(type, DIV)] = len, [HEADER(type, OR)] = len,                       \
+	[HEADER(type, AND)] = len, [HEADER(type, NOT)] = len,                      \
+	[HEADER(type, XOR)] = len, [HEADER(type, CMP)] = len,                      \
+	[HEADER(type, STR)] = len
+
+/* encoded length for each header byte, 0 if it isn't a legal instruction.
+ * one argument instructions are 2 here, the mode byte decides the rest */
+static const uint8_t inst_len[256] = {
+	[HEADER(NO, RET)] = 1,
+	[HEADER(NO, RETI)] = 1,
+	[HEADER(NO, SYSRET)] = 1,
+	[HEADER(NO, SYSCALL)] = 1,
+	[HEADER(NO, HLT)] = 1,
+	[HEADER(OA, PUSH)] = 2,
+	[HEADER(OA, POP)] = 2,
+	[HEADER(OA, CALL)] = 2,
+	REG_OPS(RR, 3),
+	[HEADER(RM, MOV)] = 10,
+	[HEADER(RM, COANDSW)] = 10,
+	REG_OPS(RI, 10),
+	[HEADER(CM, CMOV)] = 4,
+};
+
+#undef REG_OPS
+#undef HEADER
+
+static uint64_t reject(struct core *c, enum decode_policy policy,
+					   uint16_t vector) {
+	if (policy == DECODE_RAISE)
+		irc_raise_interrupt(c->irc, vector);
+	return 0;
+}
+
+uint64_t parse_instruction(struct core *c, struct instruction *inst,
+						   uint64_t old_pc, enum decode_policy policy) {
+	struct fetch f;
+	if (!fetch_start(c, &f, old_pc))
+		return reject(c, policy, ICR_PAGE_FAULT);
+
+	const uint8_t header = f.bytes[0];
 	inst->type = header >> 5;
 	inst->opcode = header & 0x1F;
-	uint64_t new_pc = old_pc + 1;
-
+	size_t len = inst_len[header];
+	if (len == 0)
+		return reject(c, policy, ICR_INVALID_OPCODE);
+	if (len == 1)
+		return old_pc + 1;
+
+	/* byte 1 is checked before anything past it is fetched */
+	if (!fetch_need(c, &f, old_pc, 2))
+		return reject(c, policy, ICR_PAGE_FAULT);
+	const uint8_t b1 = f.bytes[1];
 	switch (inst->type) {
-	case NO:
-		switch (inst->opcode) {
-		case RET:
-		case RETI:
-		case SYSRET:
-		case SYSCALL:
-		case HLT:
-			return new_pc;
-		default:
-			return 0;
-		}
-
 	case OA:
-		switch (inst->opcode) {
-		case PUSH:
-		case POP:
-		case CALL:
-			break;
-		default:
-			return 0;
-		}
-		inst->one_arg.mode = vread8(c, new_pc++);
-		if (inst->one_arg.mode == REGISTER) {
-			inst->one_arg.reg = vread8(c, new_pc++);
-			if (!is_valid_reg(inst->one_arg.reg)) {
-				return 0;
-			}
-		} else if (inst->one_arg.mode == ADDRESS) {
-			inst->one_arg.address = vread64(c, new_pc);
-			new_pc += 8;
-		} else if (inst->one_arg.mode == IMM) {
-			inst->one_arg.imm64 = vread64(c, new_pc);
-			new_pc += 8;
-		} else {
-			return 0;
-		}
-		return new_pc;
-
-	case RR: {
-		switch (inst->opcode) {
-		case MOV:
-		case ADD:
-		case SUB:
-		case MUL:
-		case DIV:
-		case OR:
-		case AND:
-		case NOT:
-		case XOR:
-		case CMP:
-		case STR:
-			break;
-		default:
-			return 0;
-		}
-		uint8_t r1 = vread8(c, new_pc++);
-		uint8_t r2 = vread8(c, new_pc++);
-		if (!is_valid_reg(r1) || !is_valid_reg(r2)) {
-			return 0;
-		}
-		inst->register_register.reg1 = r1;
-		inst->register_register.reg2 = r2;
-		return new_pc;
-	}
-
-	case RM: {
-		switch (inst->opcode) {
-		case MOV:
-		case COANDSW:
-			break;
-		default:
-			return 0;
-		}
-		uint8_t r = vread8(c, new_pc++);
-		if (!is_valid_reg(r)) {
-			return 0;
-		}
-		inst->register_memory.reg1 = r;
-		inst->register_memory.address = vread64(c, new_pc);
-		new_pc += 8;
-		return new_pc;
+		inst->one_arg.mode = b1;
+		if (b1 == REGISTER)
+			len = 3;
+		else if (b1 == ADDRESS || b1 == IMM)
+			len = 10;
+		else
+			return reject(c, policy, ICR_INVALID_OPCODE);
+		break;
+	case CM:
+		if ((b1 >> 4) > GE)
+			return reject(c, policy, ICR_INVALID_OPCODE);
+		break;
+	default:
+		if (!is_valid_reg(b1))
+			return reject(c, policy, ICR_INVALID_OPCODE);
+		break;
 	}
+	if (!fetch_need(c, &f, old_pc, len))
+		return reject(c, policy, ICR_PAGE_FAULT);
 
-	case RI: {
-		switch (inst->opcode) {
-		case MOV:
-		case ADD:
-		case SUB:
-		case MUL:
-		case DIV:
-		case OR:
-		case AND:
-		case NOT:
-		case XOR:
-		case CMP:
-		case STR:
+	switch (inst->type) {
+	case OA:
+		if (b1 != REGISTER) {
+			/* address and imm64 share storage */
+			inst->one_arg.imm64 = fetch64(&f, 2);
 			break;
-		default:
-			return 0;
 		}
-		uint8_t r = vread8(c, new_pc++);
-		if (!is_valid_reg(r)) {
-			return 0;
-		}
-		inst->register_imm.reg1 = r;
-		inst->register_imm.imm64 = vread64(c, new_pc);
-		new_pc += 8;
-		return new_pc;
-	}
-
+		if (!is_valid_reg(f.bytes[2]))
+			return reject(c, policy, ICR_INVALID_OPCODE);
+		inst->one_arg.reg = f.bytes[2];
+		break;
+	case RR:
+		if (!is_valid_reg(f.bytes[2]))
+			return reject(c, policy, ICR_INVALID_OPCODE);
+		inst->register_register.reg1 = b1;
+		inst->register_register.reg2 = f.bytes[2];
+		break;
+	case RM:
+		inst->register_memory.reg1 = b1;
+		inst->register_memory.address = fetch64(&f, 2);
+		break;
+	case RI:
+		inst->register_imm.reg1 = b1;
+		inst->register_imm.imm64 = fetch64(&f, 2);
+		break;
 	case CM:
-		if (inst->opcode != CMOV)
-			return 0;
-		{
-			uint8_t mb = vread8(c, new_pc++);
-			uint8_t cond = mb >> 4;
-			if (cond > GE) {
-				return 0;
-			}
-			inst->cmove.cond = (enum cmove_argument_mode)cond;
-
-			uint8_t r1 = vread8(c, new_pc++);
-			uint8_t r2 = vread8(c, new_pc++);
-			if (!is_valid_reg(r1) || !is_valid_reg(r2)) {
-				return 0;
-			}
-			inst->cmove.reg1 = r1;
-			inst->cmove.reg2 = r2;
-			return new_pc;
-		}
-
+		if (!is_valid_reg(f.bytes[2]) || !is_valid_reg(f.bytes[3]))
+			return reject(c, policy, ICR_INVALID_OPCODE);
+		inst->cmove.cond = (enum cmove_argument_mode)(b1 >> 4);
+		inst->cmove.reg1 = f.bytes[2];
+		inst->cmove.reg2 = f.bytes[3];
+		break;
 	default:
-		return 0;
+		break;
 	}
-}
\ No newline at end of file
+	return old_pc + len;
+}
@@ -89,12 +89,22 @@ struct instruction {
 	};
 };
 
+#define NO_REG 0xFF
+
 int is_valid_reg(uint8_t r);
 
-uint64_t parse_instruction(struct core *c, struct instruction *inst,
-						   uint64_t old_pc);
+/* register written by inst, NO_REG if it only touches memory or flags */
+uint8_t inst_dest_reg(const struct instruction *inst);
 
-uint64_t parse_instruction_ro(struct core *c, struct instruction *inst,
-							  uint64_t old_pc);
+/* DECODE_QUIET is for looking at code without running it, like the
+ * disassembly pane or decoding ahead of PC */
+enum decode_policy : uint8_t {
+	DECODE_RAISE, /* raise the fault that executing it would take */
+	DECODE_QUIET,
+};
+
+/* returns the address of the next instruction, 0 if inst isn't valid */
+uint64_t parse_instruction(struct core *c, struct instruction *inst,
+						   uint64_t old_pc, enum decode_policy policy);
 
 #endif // INST_H
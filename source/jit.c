@@ -0,0 +1,870 @@
+#include <bcache.h>
+#include <cpu.h>
+#include <inst.h>
+#include <jit.h>
+#include <paging.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__)
+
+enum host_reg : uint8_t {
+	X86_RAX,
+	X86_RCX,
+	X86_RDX,
+	X86_RBX,
+	X86_RSP,
+	X86_RBP,
+	X86_RSI,
+	X86_RDI,
+	X86_R8,
+	X86_R9,
+	X86_R10,
+	X86_R11,
+	X86_R12,
+	X86_R13,
+	X86_R14,
+	X86_R15,
+};
+
+enum host_cc : uint8_t {
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_A = 0x7,
+	CC_L = 0xC,
+};
+
+/* rbp holds the core and r15 the remaining budget for the whole run, guest
+ * registers get cached in the other callee saved ones within a block */
+static const uint8_t cache_regs[] = {X86_RBX, X86_R12, X86_R13, X86_R14};
+#define CACHE_REGS (sizeof cache_regs / sizeof *cache_regs)
+
+#define REG_OFF(r) ((int32_t)(offsetof(struct core, registers) + 8 * (r)))
+#define FLAGS_OFF(f)                                                           \
+	((int32_t)(offsetof(struct core, flags) + offsetof(struct lazy_flags, f)))
+
+typedef int64_t (*jit_enter_fn)(struct core *c, uint8_t *code, int64_t budget,
+								uint8_t **patch);
+
+/* how a guest instruction gets translated */
+enum jit_kind : uint8_t {
+	K_HELPER, /* cpu_exec_inst() */
+	K_MOV,
+	K_LOAD,
+	K_STORE,
+	K_ARITH, /* add, sub, mul, cmp */
+	K_LOGIC,
+	K_CMOV,
+	K_JUMP, /* mov or cmov into PC */
+};
+
+struct jctx {
+	struct jit *jit;
+	const struct block *b;
+	uint8_t *p;
+
+	uint8_t host[32]; /* host register caching a guest register, 0 if none */
+	uint32_t dirty;	  /* cached registers newer than core.registers */
+	uint32_t known;	  /* registers holding a compile time constant */
+	uint64_t value[32];
+	enum flags_op flags; /* last producer in this block, FLAGS_NONE if none */
+};
+
+static inline void emit8(struct jctx *j, uint8_t v) { *j->p++ = v; }
+
+static inline void emit32(struct jctx *j, uint32_t v) {
+	memcpy(j->p, &v, sizeof v);
+	j->p += sizeof v;
+}
+
+static inline void emit64(struct jctx *j, uint64_t v) {
+	memcpy(j->p, &v, sizeof v);
+	j->p += sizeof v;
+}
+
+static inline void modrm(struct jctx *j, uint8_t mod, uint8_t reg, uint8_t rm) {
+	emit8(j, mod << 6 | (reg & 7) << 3 | (rm & 7));
+}
+
+static inline void rex_w(struct jctx *j, uint8_t reg, uint8_t rm) {
+	emit8(j, 0x48 | (reg & 8) >> 1 | (rm & 8) >> 3);
+}
+
+/* op r/m64, r64 between two registers */
+static void op_rr(struct jctx *j, uint8_t op, uint8_t dst, uint8_t src) {
+	rex_w(j, src, dst);
+	emit8(j, op);
+	modrm(j, 3, src, dst);
+}
+
+/* op with a [rbp + disp32] operand, rbp being the core */
+static void op_mem(struct jctx *j, uint8_t op, uint8_t reg, int32_t disp) {
+	rex_w(j, reg, X86_RBP);
+	emit8(j, op);
+	modrm(j, 2, reg, X86_RBP);
+	emit32(j, disp);
+}
+
+#define mov_rr(j, d, s) op_rr(j, 0x89, d, s)
+#define load(j, r, d) op_mem(j, 0x8B, r, d)
+#define store(j, r, d) op_mem(j, 0x89, r, d)
+
+static void movabs(struct jctx *j, uint8_t r, uint64_t imm) {
+	emit8(j, 0x48 | (r & 8) >> 3);
+	emit8(j, 0xB8 | (r & 7));
+	emit64(j, imm);
+}
+
+static void mov_imm(struct jctx *j, uint8_t r, uint64_t imm) {
+	if ((int64_t)imm != (int32_t)imm) {
+		movabs(j, r, imm);
+		return;
+	}
+	rex_w(j, 0, r);
+	emit8(j, 0xC7);
+	modrm(j, 3, 0, r);
+	emit32(j, (uint32_t)imm);
+}
+
+static void store_imm(struct jctx *j, int32_t disp, uint64_t imm) {
+	if ((int64_t)imm != (int32_t)imm) {
+		movabs(j, X86_RAX, imm);
+		store(j, X86_RAX, disp);
+		return;
+	}
+	op_mem(j, 0xC7, 0, disp);
+	emit32(j, (uint32_t)imm);
+}
+
+static void store_byte(struct jctx *j, int32_t disp, uint8_t imm) {
+	emit8(j, 0xC6);
+	modrm(j, 2, 0, X86_RBP);
+	emit32(j, disp);
+	emit8(j, imm);
+}
+
+static void call(struct jctx *j, const void *fn) {
+	movabs(j, X86_RAX, (uint64_t)fn);
+	emit8(j, 0xFF);
+	modrm(j, 3, 2, X86_RAX);
+}
+
+static void jmp_to(struct jctx *j, const uint8_t *target) {
+	emit8(j, 0xE9);
+	emit32(j, (uint32_t)(target - (j->p + 4)));
+}
+
+/* forward conditional jump, returns the rel32 to hand to fixup() */
+static uint8_t *jcc(struct jctx *j, enum host_cc cc) {
+	emit8(j, 0x0F);
+	emit8(j, 0x80 | cc);
+	emit32(j, 0);
+	return j->p - 4;
+}
+
+static void jcc_to(struct jctx *j, enum host_cc cc, const uint8_t *target) {
+	emit8(j, 0x0F);
+	emit8(j, 0x80 | cc);
+	emit32(j, (uint32_t)(target - (j->p + 4)));
+}
+
+static void fixup(struct jctx *j, uint8_t *rel) {
+	uint32_t v = (uint32_t)(j->p - (rel + 4));
+	memcpy(rel, &v, sizeof v);
+}
+
+static void push(struct jctx *j, uint8_t r) {
+	if (r & 8)
+		emit8(j, 0x41);
+	emit8(j, 0x50 | (r & 7));
+}
+
+static void pop(struct jctx *j, uint8_t r) {
+	if (r & 8)
+		emit8(j, 0x41);
+	emit8(j, 0x58 | (r & 7));
+}
+
+/* called from generated code */
+
+/* devices and events see the count at the start of the current block, as
+ * with the interpreters. left is r15 */
+static void jit_sync_retired(struct core *c, int64_t left) {
+	c->retired = c->jit->run_retired + (c->jit->run_budget - left);
+}
+
+static uint64_t jit_load(struct core *c, uint64_t addr, int64_t left) {
+	jit_sync_retired(c, left);
+	return vread64(c, addr);
+}
+
+static bool jit_store(struct core *c, uint64_t addr, uint64_t val,
+					  uint64_t next, int64_t left) {
+	uint64_t gen = c->bcache->gen;
+	uint64_t deadline = c->deadline;
+	jit_sync_retired(c, left);
+	vwrite64(c, addr, val);
+	/* r15 was clamped to the old deadline, a device may have moved it */
+	return c->registers[PC] != next || c->bcache->gen != gen ||
+		   c->deadline != deadline || cpu_pending(c);
+}
+
+static bool jit_exec(struct core *c, const struct block_inst *bi, uint64_t pc,
+					 int64_t left) {
+	uint64_t gen = c->bcache->gen;
+	uint64_t flushes = c->tlb.flushes;
+	uint64_t deadline = c->deadline;
+	jit_sync_retired(c, left);
+	if (!cpu_exec_inst(c, bi, pc)) {
+		c->jit->halted = true;
+		return true;
+	}
+	/* a PPTR write has to get back to jit_run() before the next chained
+	 * jump */
+	return c->registers[PC] != pc + bi->len || c->bcache->gen != gen ||
+		   c->tlb.flushes != flushes || c->deadline != deadline;
+}
+
+/* FR and everything above it stay with the interpreter */
+static inline bool src_ok(uint8_t r) { return r <= PC; }
+static inline bool dst_ok(uint8_t r) { return r < PC; }
+
+static enum jit_kind binary(const struct instruction *in, enum jit_kind k) {
+	if (in->type == RR)
+		return dst_ok(in->register_register.reg1) &&
+					   src_ok(in->register_register.reg2)
+				   ? k
+				   : K_HELPER;
+	return dst_ok(in->register_imm.reg1) ? k : K_HELPER;
+}
+
+static enum jit_kind classify(const struct instruction *in) {
+	switch (in->opcode) {
+	case MOV:
+		if (in->type == RM)
+			return dst_ok(in->register_memory.reg1) ? K_LOAD : K_HELPER;
+		if (in->type == RR) {
+			if (!src_ok(in->register_register.reg2))
+				return K_HELPER;
+			if (in->register_register.reg1 == PC)
+				return K_JUMP;
+			return dst_ok(in->register_register.reg1) ? K_MOV : K_HELPER;
+		}
+		if (in->register_imm.reg1 == PC)
+			return K_JUMP;
+		return dst_ok(in->register_imm.reg1) ? K_MOV : K_HELPER;
+	case STR:
+		if (in->type == RR)
+			return src_ok(in->register_register.reg1) &&
+						   src_ok(in->register_register.reg2)
+					   ? K_STORE
+					   : K_HELPER;
+		return src_ok(in->register_imm.reg1) ? K_STORE : K_HELPER;
+	case ADD:
+	case SUB:
+	case MUL:
+		return binary(in, K_ARITH);
+	case AND:
+	case OR:
+	case XOR:
+	case NOT:
+		return binary(in, K_LOGIC);
+	case CMP:
+		if (in->type == RR)
+			return src_ok(in->register_register.reg1) &&
+						   src_ok(in->register_register.reg2)
+					   ? K_ARITH
+					   : K_HELPER;
+		return src_ok(in->register_imm.reg1) ? K_ARITH : K_HELPER;
+	case CMOV:
+		if (!src_ok(in->cmove.reg2))
+			return K_HELPER;
+		if (in->cmove.reg1 == PC)
+			return K_JUMP;
+		return dst_ok(in->cmove.reg1) ? K_CMOV : K_HELPER;
+	default:
+		return K_HELPER;
+	}
+}
+
+/* true if a later instruction replaces the flags before anything can look at
+ * them, so the producer at i doesn't have to store them */
+static bool flags_dead(const enum jit_kind *kind, uint32_t i, uint32_t count) {
+	for (uint32_t n = i + 1; n < count; n++) {
+		if (kind[n] == K_ARITH)
+			return true;
+		if (kind[n] != K_MOV)
+			return false;
+	}
+	return false;
+}
+
+static void pick_cached(struct jctx *j, const enum jit_kind *kind) {
+	uint32_t uses[32] = {0};
+	for (uint32_t i = 0; i < j->b->count; i++) {
+		const struct instruction *in = &j->b->insts[i].inst;
+		uint8_t a = NO_REG, b = NO_REG;
+		if (kind[i] == K_HELPER)
+			continue;
+		switch (in->type) {
+		case RR:
+			a = in->register_register.reg1;
+			b = in->register_register.reg2;
+			break;
+		case RM:
+			a = in->register_memory.reg1;
+			break;
+		case RI:
+			a = in->register_imm.reg1;
+			break;
+		case CM:
+			a = in->cmove.reg1;
+			b = in->cmove.reg2;
+			break;
+		default:
+			break;
+		}
+		if (a < 32)
+			uses[a]++;
+		if (b < 32)
+			uses[b]++;
+	}
+
+	for (size_t n = 0; n < CACHE_REGS; n++) {
+		uint8_t best = 0;
+		for (uint8_t g = 1; g < 32; g++)
+			if (uses[g] > uses[best])
+				best = g;
+		if (uses[best] < 2)
+			break;
+		j->host[best] = cache_regs[n];
+		uses[best] = 0;
+	}
+}
+
+static void ld(struct jctx *j, uint8_t host, uint8_t g, uint64_t next) {
+	if (g == PC)
+		mov_imm(j, host, next);
+	else if (j->known & (1u << g))
+		mov_imm(j, host, j->value[g]);
+	else if (j->host[g])
+		mov_rr(j, host, j->host[g]);
+	else
+		load(j, host, REG_OFF(g));
+}
+
+static void st(struct jctx *j, uint8_t g, uint8_t host) {
+	j->known &= ~(1u << g);
+	if (j->host[g]) {
+		mov_rr(j, j->host[g], host);
+		j->dirty |= 1u << g;
+	} else
+		store(j, host, REG_OFF(g));
+}
+
+/* stores dirty cached registers, the mask is left alone for exits that sit
+ * on a side path */
+static void flush_regs(struct jctx *j) {
+	for (uint8_t g = 0; g < 32; g++)
+		if (j->dirty & (1u << g))
+			store(j, j->host[g], REG_OFF(g));
+}
+
+static void reload_regs(struct jctx *j) {
+	for (uint8_t g = 0; g < 32; g++)
+		if (j->host[g])
+			load(j, j->host[g], REG_OFF(g));
+}
+
+static void sub_budget(struct jctx *j, uint32_t n) {
+	if (n == 0)
+		return;
+	emit8(j, 0x49);
+	emit8(j, 0x81);
+	modrm(j, 3, 5, X86_R15);
+	emit32(j, n);
+}
+
+/* leaves after n instructions with PC already in core.registers */
+static void exit_dynamic(struct jctx *j, uint32_t n) {
+	flush_regs(j);
+	sub_budget(j, n);
+	jmp_to(j, j->jit->exit);
+}
+
+/* leaves after n instructions for a known target, the jump gets patched to
+ * go straight to the target's code once it is compiled */
+static void exit_chain(struct jctx *j, uint32_t n, uint64_t target) {
+	flush_regs(j);
+	sub_budget(j, n);
+	store_imm(j, REG_OFF(PC), target);
+	movabs(j, X86_RAX, (uint64_t)(j->p + 10 + 1));
+	jmp_to(j, j->jit->link);
+}
+
+static void commit_flags(struct jctx *j, enum flags_op op) {
+	store(j, X86_RAX, FLAGS_OFF(res));
+	if (op != FLAGS_LOGIC) {
+		store(j, X86_RDX, FLAGS_OFF(a));
+		store(j, X86_RCX, FLAGS_OFF(b));
+	}
+	store_byte(j, FLAGS_OFF(op), op);
+}
+
+/* jump taken when the CMOV condition does not hold */
+static uint8_t *cond_false(struct jctx *j, uint8_t cond) {
+	if (j->flags != FLAGS_NONE && (cond == EQ || cond == NE)) {
+		/* ZF only depends on the stored result */
+		op_mem(j, 0x83, 7, FLAGS_OFF(res));
+		emit8(j, 0);
+		return jcc(j, cond == EQ ? CC_NE : CC_E);
+	}
+	mov_rr(j, X86_RDI, X86_RBP);
+	mov_imm(j, X86_RSI, cond);
+	call(j, cpu_cond_ok);
+	emit8(j, 0x84); /* test al, al */
+	modrm(j, 3, X86_RAX, X86_RAX);
+	return jcc(j, CC_E);
+}
+
+/* logic ops keep CF/OF, so a pending arithmetic op has to be folded first */
+static void sync_before_logic(struct jctx *j) {
+	if (j->flags == FLAGS_LOGIC)
+		return;
+	uint8_t *skip = nullptr;
+	if (j->flags == FLAGS_NONE) {
+		emit8(j, 0x0F); /* movzx eax, byte [op] */
+		emit8(j, 0xB6);
+		modrm(j, 2, X86_RAX, X86_RBP);
+		emit32(j, FLAGS_OFF(op));
+		emit8(j, 0x83); /* sub eax, FLAGS_ADD */
+		modrm(j, 3, 5, X86_RAX);
+		emit8(j, FLAGS_ADD);
+		emit8(j, 0x83); /* cmp eax, FLAGS_MUL - FLAGS_ADD */
+		modrm(j, 3, 7, X86_RAX);
+		emit8(j, FLAGS_MUL - FLAGS_ADD);
+		skip = jcc(j, CC_A);
+	}
+	mov_rr(j, X86_RDI, X86_RBP);
+	call(j, cpu_sync_flags);
+	if (skip)
+		fixup(j, skip);
+}
+
+static void emit_alu(struct jctx *j, const struct instruction *in,
+					 uint64_t next, bool commit) {
+	const bool rr = in->type == RR;
+	const uint8_t r1 = rr ? in->register_register.reg1 : in->register_imm.reg1;
+	enum flags_op op;
+
+	if (in->opcode == AND || in->opcode == OR || in->opcode == XOR ||
+		in->opcode == NOT)
+		sync_before_logic(j);
+
+	ld(j, X86_RAX, r1, next);
+	if (in->opcode != NOT) {
+		if (rr)
+			ld(j, X86_RCX, in->register_register.reg2, next);
+		else
+			mov_imm(j, X86_RCX, in->register_imm.imm64);
+	}
+
+	switch (in->opcode) {
+	case ADD:
+		mov_rr(j, X86_RDX, X86_RAX);
+		op_rr(j, 0x01, X86_RAX, X86_RCX);
+		op = FLAGS_ADD;
+		break;
+	case SUB:
+	case CMP:
+		mov_rr(j, X86_RDX, X86_RAX);
+		op_rr(j, 0x29, X86_RAX, X86_RCX);
+		op = FLAGS_SUB;
+		break;
+	case MUL:
+		mov_rr(j, X86_RDX, X86_RAX);
+		rex_w(j, X86_RAX, X86_RCX); /* imul rax, rcx */
+		emit8(j, 0x0F);
+		emit8(j, 0xAF);
+		modrm(j, 3, X86_RAX, X86_RCX);
+		op = FLAGS_MUL;
+		break;
+	case AND:
+		op_rr(j, 0x21, X86_RAX, X86_RCX);
+		op = FLAGS_LOGIC;
+		break;
+	case OR:
+		op_rr(j, 0x09, X86_RAX, X86_RCX);
+		op = FLAGS_LOGIC;
+		break;
+	case XOR:
+		op_rr(j, 0x31, X86_RAX, X86_RCX);
+		op = FLAGS_LOGIC;
+		break;
+	default: /* NOT ignores its second operand */
+		rex_w(j, 0, X86_RAX);
+		emit8(j, 0xF7);
+		modrm(j, 3, 2, X86_RAX);
+		op = FLAGS_LOGIC;
+		break;
+	}
+
+	if (in->opcode != CMP)
+		st(j, r1, X86_RAX);
+	if (commit)
+		commit_flags(j, op);
+	j->flags = op;
+}
+
+static void emit_inst(struct jctx *j, uint32_t i, uint64_t pc,
+					  enum jit_kind kind, bool commit) {
+	const struct block_inst *bi = &j->b->insts[i];
+	const struct instruction *in = &bi->inst;
+	const uint64_t next = pc + bi->len;
+	const uint32_t n = i + 1;
+	const bool last = n == j->b->count;
+	uint8_t *skip;
+
+	switch (kind) {
+	case K_MOV:
+		if (in->type == RR) {
+			const uint8_t d = in->register_register.reg1;
+			const uint8_t s = in->register_register.reg2;
+			ld(j, X86_RAX, s, next);
+			st(j, d, X86_RAX);
+			if (s == PC || (j->known & (1u << s))) {
+				j->known |= 1u << d;
+				j->value[d] = s == PC ? next : j->value[s];
+			}
+		} else {
+			const uint8_t d = in->register_imm.reg1;
+			mov_imm(j, X86_RAX, in->register_imm.imm64);
+			st(j, d, X86_RAX);
+			j->known |= 1u << d;
+			j->value[d] = in->register_imm.imm64;
+		}
+		break;
+
+	case K_LOAD:
+		store_imm(j, REG_OFF(PC), next);
+		mov_rr(j, X86_RDI, X86_RBP);
+		mov_imm(j, X86_RSI, in->register_memory.address);
+		mov_rr(j, X86_RDX, X86_R15);
+		call(j, jit_load);
+		/* a page fault moved PC to the handler */
+		mov_imm(j, X86_RCX, next);
+		op_mem(j, 0x39, X86_RCX, REG_OFF(PC));
+		skip = jcc(j, CC_E);
+		exit_dynamic(j, n);
+		fixup(j, skip);
+		st(j, in->register_memory.reg1, X86_RAX);
+		break;
+
+	case K_STORE:
+		store_imm(j, REG_OFF(PC), next);
+		if (in->type == RR) {
+			ld(j, X86_RSI, in->register_register.reg1, next);
+			ld(j, X86_RDX, in->register_register.reg2, next);
+		} else {
+			mov_imm(j, X86_RSI, in->register_imm.imm64);
+			ld(j, X86_RDX, in->register_imm.reg1, next);
+		}
+		mov_rr(j, X86_RDI, X86_RBP);
+		mov_imm(j, X86_RCX, next);
+		mov_rr(j, X86_R8, X86_R15);
+		call(j, jit_store);
+		emit8(j, 0x84); /* test al, al */
+		modrm(j, 3, X86_RAX, X86_RAX);
+		skip = jcc(j, CC_E);
+		exit_dynamic(j, n);
+		fixup(j, skip);
+		break;
+
+	case K_ARITH:
+	case K_LOGIC:
+		emit_alu(j, in, next, commit);
+		break;
+
+	case K_CMOV:
+		skip = cond_false(j, in->cmove.cond);
+		ld(j, X86_RAX, in->cmove.reg2, next);
+		st(j, in->cmove.reg1, X86_RAX);
+		fixup(j, skip);
+		break;
+
+	case K_JUMP: {
+		const uint8_t s = in->type == RI   ? NO_REG
+						  : in->type == RR ? in->register_register.reg2
+										   : in->cmove.reg2;
+		skip = in->type == CM ? cond_false(j, in->cmove.cond) : nullptr;
+		if (s == NO_REG)
+			exit_chain(j, n, in->register_imm.imm64);
+		else if (s == PC)
+			exit_chain(j, n, next);
+		else if (j->known & (1u << s))
+			exit_chain(j, n, j->value[s]);
+		else {
+			ld(j, X86_RAX, s, next);
+			store(j, X86_RAX, REG_OFF(PC));
+			exit_dynamic(j, n);
+		}
+		if (skip) {
+			fixup(j, skip);
+			exit_chain(j, n, next);
+		}
+		return;
+	}
+
+	case K_HELPER:
+		flush_regs(j);
+		j->dirty = 0;
+		mov_rr(j, X86_RDI, X86_RBP);
+		mov_imm(j, X86_RSI, (uint64_t)bi);
+		mov_imm(j, X86_RDX, pc);
+		mov_rr(j, X86_RCX, X86_R15);
+		call(j, jit_exec);
+		if (last) {
+			exit_dynamic(j, n);
+			return;
+		}
+		emit8(j, 0x84); /* test al, al */
+		modrm(j, 3, X86_RAX, X86_RAX);
+		skip = jcc(j, CC_E);
+		exit_dynamic(j, n);
+		fixup(j, skip);
+		reload_regs(j);
+		j->known = 0;
+		j->flags = FLAGS_NONE;
+		break;
+	}
+
+	/* the block ran out of length or crossed a page */
+	if (last)
+		exit_chain(j, n, next);
+}
+
+/* the buffer is writable or executable, never both. whatever writes to it
+ * opens it first, jit_run() seals it again before generated code runs */
+static bool code_writable(struct jit *j) {
+	if (!j->writable)
+		j->writable =
+			mprotect(j->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE) == 0;
+	return j->writable;
+}
+
+static bool code_executable(struct jit *j) {
+	if (j->writable)
+		j->writable =
+			mprotect(j->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0;
+	return !j->writable;
+}
+
+static void jit_flush(struct core *c) {
+	struct jit *j = c->jit;
+	struct bcache *bc = c->bcache;
+	for (uint32_t i = 0; i < bc->used; i++)
+		bc->blocks[i].jit = nullptr;
+	j->used = j->stubs;
+	j->patch = nullptr;
+	j->nlinks = 0;
+	j->gen = bc->gen;
+	j->epoch = bc->epoch;
+	j->flushes = c->tlb.flushes;
+}
+
+/* points every patched jump back at the link stub, or forgets all code if
+ * the jumps can't be written */
+static void jit_unlink(struct core *c) {
+	struct jit *j = c->jit;
+	if (j->nlinks != 0 && !code_writable(j)) {
+		jit_flush(c);
+		return;
+	}
+	for (uint32_t i = 0; i < j->nlinks; i++) {
+		uint32_t rel = (uint32_t)(j->link - (j->links[i] + 4));
+		memcpy(j->links[i], &rel, sizeof rel);
+	}
+	j->nlinks = 0;
+	j->patch = nullptr;
+	j->gen = c->bcache->gen;
+	j->flushes = c->tlb.flushes;
+}
+
+static bool jit_compile(struct core *c, struct block *b, uint64_t vaddr) {
+	struct jit *jit = c->jit;
+	if (!code_writable(jit))
+		return false;
+	if (jit->used + JIT_BLOCK_MAX > JIT_CODE_SIZE)
+		jit_flush(c);
+
+	struct jctx j = {.jit = jit, .b = b, .p = jit->code + jit->used};
+	enum jit_kind kind[BCACHE_MAX_INSTS];
+	for (uint32_t i = 0; i < b->count; i++)
+		kind[i] = classify(&b->insts[i].inst);
+	pick_cached(&j, kind);
+
+	b->jit = j.p;
+	b->jit_vaddr = vaddr;
+
+	/* the rest of the budget is too short for the whole block or we are
+	 * asked to stop, PC already points here */
+	emit8(&j, 0x49); /* cmp r15, count */
+	emit8(&j, 0x81);
+	modrm(&j, 3, 7, X86_R15);
+	emit32(&j, b->count);
+	jcc_to(&j, CC_L, jit->exit);
+	emit8(&j, 0x83); /* cmp dword [requests], 0 */
+	modrm(&j, 2, 7, X86_RBP);
+	emit32(&j, offsetof(struct core, requests));
+	emit8(&j, 0);
+	jcc_to(&j, CC_NE, jit->exit);
+	reload_regs(&j);
+
+	uint64_t pc = vaddr;
+	for (uint32_t i = 0; i < b->count; i++) {
+		emit_inst(&j, i, pc, kind[i], !flags_dead(kind, i, b->count));
+		pc += b->insts[i].len;
+	}
+
+	jit->used = j.p - jit->code;
+	jit->compiled++;
+	return true;
+}
+
+static void emit_stubs(struct jit *jit) {
+	struct jctx j = {.jit = jit, .p = jit->code};
+
+	/* int64_t enter(core, code, budget, patch) */
+	jit->enter = j.p;
+	push(&j, X86_RBX);
+	push(&j, X86_RBP);
+	push(&j, X86_R12);
+	push(&j, X86_R13);
+	push(&j, X86_R14);
+	push(&j, X86_R15);
+	push(&j, X86_RCX); /* keeps the stack 16 byte aligned for helper calls */
+	mov_rr(&j, X86_RBP, X86_RDI);
+	mov_rr(&j, X86_R15, X86_RDX);
+	emit8(&j, 0xFF); /* jmp rsi */
+	modrm(&j, 3, 4, X86_RSI);
+
+	/* returns the budget left */
+	jit->exit = j.p;
+	mov_rr(&j, X86_RAX, X86_R15);
+	pop(&j, X86_RCX);
+	pop(&j, X86_R15);
+	pop(&j, X86_R14);
+	pop(&j, X86_R13);
+	pop(&j, X86_R12);
+	pop(&j, X86_RBP);
+	pop(&j, X86_RBX);
+	emit8(&j, 0xC3);
+
+	/* rax is the rel32 of an unlinked jump, hand it to jit_run() */
+	jit->link = j.p;
+	emit8(&j, 0x48); /* mov rcx, [rsp] */
+	emit8(&j, 0x8B);
+	emit8(&j, 0x0C);
+	emit8(&j, 0x24);
+	emit8(&j, 0x48); /* mov [rcx], rax */
+	emit8(&j, 0x89);
+	emit8(&j, 0x01);
+	jmp_to(&j, jit->exit);
+
+	jit->stubs = j.p - jit->code;
+}
+
+bool jit_init(struct core *c) {
+	struct jit *jit = calloc(1, sizeof *jit);
+	if (jit == nullptr)
+		return false;
+	jit->code = mmap(nullptr, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	jit->writable = true;
+	jit->links = malloc(JIT_LINKS * sizeof *jit->links);
+	if (jit->code == MAP_FAILED || jit->links == nullptr) {
+		if (jit->code != MAP_FAILED)
+			munmap(jit->code, JIT_CODE_SIZE);
+		free(jit->links);
+		free(jit);
+		return false;
+	}
+	emit_stubs(jit);
+	if (!code_executable(jit)) {
+		munmap(jit->code, JIT_CODE_SIZE);
+		free(jit->links);
+		free(jit);
+		return false;
+	}
+	c->jit = jit;
+	jit_flush(c);
+	return true;
+}
+
+uint64_t jit_run(struct core *c, uint64_t budget, bool *running) {
+	struct jit *jit = c->jit;
+	struct bcache *bc = c->bcache;
+	const uint64_t pc = c->registers[PC];
+
+	*running = true;
+	struct block *b = (struct block *)bcache_lookup(c, pc);
+	if (b == nullptr)
+		return 1;
+	if (b == &bc->uncached) {
+		*running = cpu_exec_inst(c, &b->insts[0], pc);
+		return 1;
+	}
+
+	/* code of dropped blocks stays in the buffer, but nothing may jump to it
+	 * anymore */
+	if (jit->epoch != bc->epoch)
+		jit_flush(c);
+	if (jit->gen != bc->gen || jit->flushes != c->tlb.flushes)
+		jit_unlink(c);
+	if (b->jit == nullptr || b->jit_vaddr != pc) {
+		/* straight line code that runs once isn't worth translating */
+		if (++b->heat < JIT_HOT || !jit_compile(c, b, pc)) {
+			jit->patch = nullptr;
+			return cpu_step_block(c, budget, running);
+		}
+	}
+	/* compiled blocks only run whole, the interpreter does the tail */
+	if (b->count > budget) {
+		jit->patch = nullptr;
+		return cpu_step_block(c, budget, running);
+	}
+
+	if (jit->patch != nullptr && jit->patch_pc == pc &&
+		jit->nlinks < JIT_LINKS && code_writable(jit)) {
+		uint32_t rel = (uint32_t)(b->jit - (jit->patch + 4));
+		memcpy(jit->patch, &rel, sizeof rel);
+		jit->links[jit->nlinks++] = jit->patch;
+		jit->chained++;
+	}
+	jit->patch = nullptr;
+	if (!code_executable(jit))
+		return cpu_step_block(c, budget, running);
+	jit->halted = false;
+
+	jit->run_retired = c->retired;
+	jit->run_budget = (int64_t)budget;
+	jit_enter_fn enter = (jit_enter_fn)(void *)jit->enter;
+	int64_t left = enter(c, b->jit, (int64_t)budget, &jit->patch);
+	jit->patch_pc = c->registers[PC];
+	*running = !jit->halted;
+	/* cpu_run() adds what was done */
+	c->retired = jit->run_retired;
+	return (int64_t)budget - left;
+}
+
+#else
+
+bool jit_init(struct core *) { return false; }
+
+uint64_t jit_run(struct core *c, uint64_t budget, bool *running) {
+	return cpu_step_block(c, budget, running);
+}
+
+#endif
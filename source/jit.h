@@ -0,0 +1,54 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <cpu.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JIT_CODE_SIZE (16u << 20)
+#define JIT_BLOCK_MAX 8192 /* worst case host bytes for one guest block */
+#define JIT_HOT 16		   /* runs through the interpreter before compiling */
+#define JIT_LINKS 65536	   /* patched jumps remembered for jit_unlink() */
+
+struct jit {
+	uint8_t *code; /* blocks are appended until it is full */
+	size_t used;
+	bool writable; /* else executable */
+	size_t stubs; /* bytes taken by the shared stubs */
+	uint64_t gen;	/* bcache generation the links were made against */
+	uint64_t epoch; /* bcache epoch the code was compiled against */
+
+	/* shared stubs at the start of the buffer */
+	uint8_t *enter;
+	uint8_t *exit;
+	uint8_t *link;
+
+	/* direct jump waiting for its target to be compiled */
+	uint8_t *patch;
+	uint64_t patch_pc;
+
+	/* patched jumps go by virtual address, so they are undone whenever PPTR
+	 * is written, even with the same value, see tlb.flushes */
+	uint8_t **links;
+	uint32_t nlinks;
+	uint64_t flushes;
+
+	/* core.retired and the budget when jit_run() entered, helpers move
+	 * retired along from there */
+	uint64_t run_retired;
+	int64_t run_budget;
+
+	bool halted;
+	uint64_t compiled;
+	uint64_t chained;
+};
+
+/* false if the host can't run generated code */
+bool jit_init(struct core *c);
+
+/* runs translated blocks starting at PC until about budget instructions are
+ * done, a request comes in or something needs the interpreter loop. returns
+ * the number executed and clears *running on HLT */
+uint64_t jit_run(struct core *c, uint64_t budget, bool *running);
+
+#endif // JIT_H
@@ -3,6 +3,7 @@
 #include <inttypes.h>
 #include <ncurses.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -12,18 +13,30 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <batch.h>
+#include <blit.h>
+#include <blk.h>
 #include <cpu.h>
+#include <display.h>
+#include <err.h>
 #include <inst.h>
 #include <interrupt.h>
+#include <jit.h>
 #include <mmio.h>
 #include <paging.h>
+#include <snapshot.h>
+#include <timer.h>
 
 #define FB_WIDTH 640
 #define FB_HEIGHT 480
 #define FB_PITCH (FB_WIDTH * 4)
 #define FB_SIZE (FB_HEIGHT * FB_PITCH) + 20
 #define FB_BASE 0x90000000UL
+#define FB_MAP_SIZE ((FB_SIZE + 0xFFF) & ~0xFFFUL)
+#define FB_PAGES (FB_MAP_SIZE >> 12)
+#define FB_DAMAGE_WORDS ((FB_PAGES + 63) / 64)
 #define STEPS_PER_UPDATE 10000U
+#define BIOS_BASE 0x7FFF000UL
 
 #define KBD_BASE (0x90010000UL)
 #define KBD_SIZE 0x10
@@ -61,103 +74,263 @@ static SDL_Renderer *sdl_renderer = nullptr;
 static SDL_Texture *sdl_texture = nullptr;
 static uint8_t *fb_mem = nullptr;
 
+/* the framebuffer is RAM backed, the CPU thread moves the pages stored to
+ * into fb_pending when the UI asks, and the UI uploads the rows they cover */
+static uint64_t fb_damage[FB_DAMAGE_WORDS];
+static struct mmio_hook fb_hook = {
+	.base = FB_BASE,
+	.size = FB_MAP_SIZE,
+	.damage = fb_damage,
+};
+static _Atomic uint64_t fb_pending[FB_DAMAGE_WORDS];
+static atomic_bool fb_wanted = false;
+
 static uint8_t kbd_buf[256];
 static size_t kbd_head = 0, kbd_tail = 0;
 
 static pthread_mutex_t kbd_mtx = PTHREAD_MUTEX_INITIALIZER;
-static bool kbd_pending = false;
+
+static const char *snapshot_path = "machine.snap";
 
 static volatile bool paused = true;
-static volatile bool snapshot_ready = false;
 static volatile bool halted_global = false;
 
-static pthread_mutex_t snap_mtx = PTHREAD_MUTEX_INITIALIZER;
+#define SNAP_INSTS 128
+#define SNAP_MEM_BEFORE 256
+#define SNAP_MEM 4096
+#define SNAP_STACK 512
+#define SNAP_PAGES 64
+
+struct snap_inst {
+	uint64_t pc;
+	struct instruction inst;
+	bool valid;
+	uint8_t byte;
+};
+
+/* everything the UI shows, captured by the CPU thread between instructions so
+ * the UI never reads guest RAM itself */
 struct cpu_snapshot {
 	uint64_t regs[41];
+	struct snap_inst insts[SNAP_INSTS];
+	uint64_t mem_base;
+	size_t mem_len;
+	uint8_t mem[SNAP_MEM];
+	size_t stack_len[2]; /* SP1, SP0 */
+	uint8_t stack[2][SNAP_STACK];
+	uintptr_t pages[SNAP_PAGES];
+	bool page_ok[SNAP_PAGES];
 };
+
+/* seqlock, odd while the CPU thread is writing latest_snapshot */
+static atomic_uint_fast64_t snap_seq = 0;
+static atomic_bool snapshot_wanted = true;
 static struct cpu_snapshot latest_snapshot;
 
+static void capture_snapshot(struct core *cpu, struct cpu_snapshot *s) {
+	cpu_sync_flags(cpu);
+	memcpy(s->regs, cpu->registers, sizeof s->regs);
+
+	uint64_t addr = cpu->registers[PC];
+	for (int i = 0; i < SNAP_INSTS; i++) {
+		struct snap_inst *si = &s->insts[i];
+		uint64_t next = parse_instruction(cpu, &si->inst, addr, DECODE_QUIET);
+		si->pc = addr;
+		si->valid = next != 0;
+		if (!si->valid) {
+			si->byte = 0;
+			vpeek(cpu, addr, &si->byte, 1);
+			next = addr + 1;
+		}
+		addr = next;
+	}
+
+	uint64_t pc = cpu->registers[PC];
+	s->mem_base = pc > SNAP_MEM_BEFORE ? pc - SNAP_MEM_BEFORE : 0;
+	s->mem_len = vpeek(cpu, s->mem_base, s->mem, SNAP_MEM);
+
+	s->stack_len[0] = vpeek(cpu, cpu->registers[SP1], s->stack[0], SNAP_STACK);
+	s->stack_len[1] = vpeek(cpu, cpu->registers[SP0], s->stack[1], SNAP_STACK);
+
+	uint64_t page = pc & ~0xFFFULL;
+	for (int i = 0; i < SNAP_PAGES; i++) {
+		vm_error = VM_OK;
+		s->pages[i] = vaddr_translate(cpu, page + i * 0x1000, TLB_READ);
+		s->page_ok[i] = vm_error == VM_OK;
+	}
+}
+
+static void publish_snapshot(struct core *cpu) {
+	atomic_fetch_add_explicit(&snap_seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	capture_snapshot(cpu, &latest_snapshot);
+	atomic_fetch_add_explicit(&snap_seq, 1, memory_order_release);
+	atomic_store_explicit(&snapshot_wanted, false, memory_order_relaxed);
+}
+
+/* returns false if nothing was published since *seen */
+static bool read_snapshot(struct cpu_snapshot *out, uint64_t *seen) {
+	for (;;) {
+		uint64_t begin = atomic_load_explicit(&snap_seq, memory_order_acquire);
+		if (begin == *seen)
+			return false;
+		if (begin & 1)
+			continue;
+		memcpy(out, &latest_snapshot, sizeof *out);
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&snap_seq, memory_order_relaxed) == begin) {
+			*seen = begin;
+			return true;
+		}
+	}
+}
+
+/* written next to the old file and renamed over it, RAM may still be mapped
+ * from the old one */
+static bool save_snapshot(struct core *cpu) {
+	char tmp[4096];
+	snprintf(tmp, sizeof tmp, "%s.tmp", snapshot_path);
+	int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0 || !snapshot_save(cpu, fd) || rename(tmp, snapshot_path) < 0) {
+		perror("snapshot_save");
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
+static void collect_fb_damage(struct core *cpu) {
+	uint64_t bits[FB_DAMAGE_WORDS] = {};
+	mmio_damage_collect(cpu, &fb_hook, bits);
+	for (size_t i = 0; i < FB_DAMAGE_WORDS; i++)
+		if (bits[i] != 0)
+			atomic_fetch_or_explicit(&fb_pending[i], bits[i],
+									 memory_order_release);
+	atomic_store_explicit(&fb_wanted, false, memory_order_relaxed);
+}
+
+static void damage_whole_fb(void) {
+	for (size_t i = 0; i < FB_DAMAGE_WORDS; i++)
+		atomic_store_explicit(&fb_pending[i], ~0ull, memory_order_release);
+}
+
+static bool restore_snapshot(struct core *cpu) {
+	int fd = open(snapshot_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || !snapshot_restore(cpu, fd)) {
+		perror("snapshot_restore");
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	close(fd);
+	damage_whole_fb();
+	display_reshow();
+	timer_restored(cpu);
+	return true;
+}
+
 #define _DEBUG
 
 void *cpu_thread_func(void *arg) {
 	struct core *cpu = (struct core *)arg;
-	uint64_t step_count = 0;
 #ifdef _DEBUG
-	uint64_t interval_steps = 0;
+	uint64_t last_retired = 0;
 	struct timespec last_print_ts;
 	clock_gettime(CLOCK_MONOTONIC, &last_print_ts);
 #endif
 
 	while (!safe_load_bool(&halted_global)) {
-		bool raise_interrupt = false;
-		pthread_mutex_lock(&kbd_mtx);
-		if (kbd_pending) {
-			raise_interrupt = true;
-			kbd_pending = false;
-		}
-		pthread_mutex_unlock(&kbd_mtx);
-		if (raise_interrupt)
-			irc_raise_interrupt(cpu->irc, ICR_KEYB);
+		const uint32_t req = cpu_take_requests(cpu);
+		if (req & CPU_REQ_IRQ)
+			cpu_run_posted(cpu);
+		if (req & CPU_REQ_SAVE)
+			save_snapshot(cpu);
+		if ((req & CPU_REQ_RESTORE) && restore_snapshot(cpu))
+			publish_snapshot(cpu);
 
 		if (safe_load_bool(&paused)) {
+			if (atomic_load_explicit(&snapshot_wanted, memory_order_relaxed))
+				publish_snapshot(cpu);
+			if (atomic_load_explicit(&fb_wanted, memory_order_relaxed))
+				collect_fb_damage(cpu);
 			struct timespec ts = {0, 1000000};
 			nanosleep(&ts, nullptr);
 			continue;
 		}
 
-		if (!cpu_step(cpu)) {
+		enum cpu_exit why = cpu_run(cpu, STEPS_PER_UPDATE);
+		if (why == CPU_EXIT_HALT) {
 			safe_store_bool(&halted_global, true);
-			step_count = 0;
-			pthread_mutex_lock(&snap_mtx);
-			memcpy(latest_snapshot.regs, cpu->registers,
-				   sizeof latest_snapshot.regs);
-			safe_store_bool(&snapshot_ready, true);
-			pthread_mutex_unlock(&snap_mtx);
+			publish_snapshot(cpu);
 			break;
 		}
+		if (why == CPU_EXIT_BREAKPOINT) {
+			safe_store_bool(&paused, true);
+			publish_snapshot(cpu);
+			continue;
+		}
 
 #ifdef _DEBUG
-		interval_steps++;
-
 		struct timespec now;
 		clock_gettime(CLOCK_MONOTONIC, &now);
 		double elapsed = (now.tv_sec - last_print_ts.tv_sec) +
 						 (now.tv_nsec - last_print_ts.tv_nsec) / 1e9;
 		if (elapsed >= 1.0) {
-			double ips = interval_steps / elapsed;
+			double ips = (cpu->retired - last_retired) / elapsed;
 			fprintf(stderr, "[DEBUG] Clock speed: %.2f KHz\n", ips / 1e3);
-			interval_steps = 0;
+			fprintf(stderr,
+					"[DEBUG] TLB hits: %" PRIu64 " misses: %" PRIu64 "\n",
+					cpu->tlb.hits, cpu->tlb.misses);
+			last_retired = cpu->retired;
 			last_print_ts = now;
 		}
 #endif
 
-		if (++step_count >= STEPS_PER_UPDATE) {
-			step_count = 0;
-			pthread_mutex_lock(&snap_mtx);
-			memcpy(latest_snapshot.regs, cpu->registers,
-				   sizeof latest_snapshot.regs);
-			safe_store_bool(&snapshot_ready, true);
-			pthread_mutex_unlock(&snap_mtx);
-		}
+		if (atomic_load_explicit(&snapshot_wanted, memory_order_relaxed))
+			publish_snapshot(cpu);
+		if (atomic_load_explicit(&fb_wanted, memory_order_relaxed))
+			collect_fb_damage(cpu);
 	}
 
 	return nullptr;
 }
 
-static bool fb_mmio_read(struct core *, uintptr_t offset, void *buf,
-						 size_t len) {
-	if (offset >= FB_SIZE || offset + len > FB_SIZE)
-		return true;
-	memcpy(buf, fb_mem + offset, len);
-	return true;
-}
+/* uploads the rows covered by each run of damaged pages, false if there
+ * were none */
+static bool upload_fb_damage(void) {
+	uint64_t bits[FB_DAMAGE_WORDS];
+	for (size_t i = 0; i < FB_DAMAGE_WORDS; i++)
+		bits[i] = atomic_exchange_explicit(&fb_pending[i], 0,
+										   memory_order_acquire);
+
+	bool any = false;
+	size_t start = 0, run = 0;
+	for (size_t p = 0; p <= FB_PAGES; p++) {
+		if (p < FB_PAGES && (bits[p >> 6] & (1ull << (p & 63)))) {
+			if (run++ == 0)
+				start = p << 12;
+			continue;
+		}
+		if (run == 0)
+			continue;
+		run = 0;
 
-static bool fb_mmio_write(struct core *, uintptr_t offset, const void *buf,
-						  size_t len) {
-	if (offset >= FB_SIZE || offset + len > FB_SIZE)
-		return true;
-	memcpy(fb_mem + offset, buf, len);
-	return true;
+		size_t end = p << 12;
+		if (end > FB_HEIGHT * FB_PITCH)
+			end = FB_HEIGHT * FB_PITCH;
+		if (start >= end)
+			continue;
+		const int y0 = start / FB_PITCH, y1 = (end - 1) / FB_PITCH;
+		SDL_Rect rows = {0, y0, FB_WIDTH, y1 - y0 + 1};
+		SDL_UpdateTexture(sdl_texture, &rows, fb_mem + y0 * FB_PITCH,
+						  FB_PITCH);
+		any = true;
+	}
+	return any;
 }
 
 static bool kbd_mmio_read(struct core *, uintptr_t offset, void *buf,
@@ -227,52 +400,211 @@ static void format_inst(struct instruction *inst, uint64_t pc, char *buf,
 	}
 }
 
+static void usage(const char *prog) {
+	fprintf(stderr,
+			"Usage: %s [-e switch|threaded|jit] [-m size[K|M|G]] "
+			"[-H thp|hugetlb] [-s snapshot] [-r] [-b [-t steps]] [-d disk] "
+			"[-B addr]... <binary>\n",
+			prog);
+}
+
+/* 0 on garbage */
+static uintptr_t parse_size(const char *s) {
+	char *end;
+	unsigned long long v = strtoull(s, &end, 0);
+	switch (*end) {
+	case 'G':
+	case 'g':
+		v <<= 10;
+		[[fallthrough]];
+	case 'M':
+	case 'm':
+		v <<= 10;
+		[[fallthrough]];
+	case 'K':
+	case 'k':
+		v <<= 10;
+		end++;
+		break;
+	default:
+		break;
+	}
+	return *end == '\0' ? v : 0;
+}
+
 int main(int argc, char **argv) {
-	if (argc < 2) {
-		fprintf(stderr, "Usage: %s <binary>\n", argv[0]);
+	enum cpu_engine engine = ENGINE_SWITCH;
+	enum ram_pages pages = RAM_PAGES_SMALL;
+	uintptr_t ram_size = 1 << 30;
+	bool restore = false;
+	bool batch = false;
+	uint64_t step_limit = 100000000;
+	const char *disk = nullptr;
+	uint64_t breakpoints[CPU_MAX_BREAKPOINTS];
+	uint8_t nbreakpoints = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "e:m:H:s:rbt:d:B:")) != -1) {
+		switch (opt) {
+		case 'e':
+			if (strcmp(optarg, "switch") == 0)
+				engine = ENGINE_SWITCH;
+			else if (strcmp(optarg, "threaded") == 0)
+				engine = ENGINE_THREADED;
+			else if (strcmp(optarg, "jit") == 0)
+				engine = ENGINE_JIT;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'm':
+			ram_size = parse_size(optarg);
+			if (ram_size == 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'H':
+			if (strcmp(optarg, "thp") == 0)
+				pages = RAM_PAGES_THP;
+			else if (strcmp(optarg, "hugetlb") == 0)
+				pages = RAM_PAGES_HUGETLB;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 's':
+			snapshot_path = optarg;
+			break;
+		case 'r':
+			restore = true;
+			break;
+		case 'b':
+			batch = true;
+			break;
+		case 't':
+			step_limit = strtoull(optarg, nullptr, 0);
+			break;
+		case 'd':
+			disk = optarg;
+			break;
+		case 'B': {
+			const uint64_t addr = strtoull(optarg, nullptr, 0);
+			bool seen = false; /* a second toggle would clear it again */
+			for (uint8_t i = 0; i < nbreakpoints; i++)
+				seen |= breakpoints[i] == addr;
+			if (seen)
+				break;
+			if (nbreakpoints == CPU_MAX_BREAKPOINTS) {
+				fprintf(stderr, "At most %d breakpoints\n", CPU_MAX_BREAKPOINTS);
+				return 1;
+			}
+			breakpoints[nbreakpoints++] = addr;
+			break;
+		}
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
 		return 1;
 	}
 
-	struct ram *memory = init_memory(1 << 30);
-	FILE *f = fopen(argv[1], "rb");
-	if (!f) {
-		perror("fopen");
+	struct ram *memory = init_memory(ram_size, pages);
+	if (memory == nullptr) {
+		fprintf(stderr, "Failed to map %" PRIuPTR " bytes of guest RAM\n",
+				ram_size);
+		return 1;
+	}
+	if (!load_image(memory, argv[optind], BIOS_BASE)) {
+		perror(argv[optind]);
 		return 1;
 	}
-	fread(memory->mem + 0x7FFF000, 1, memory->cap, f);
-	fclose(f);
 
 	cpu.mem = memory;
 	cpu.irc = malloc(sizeof *cpu.irc);
 	irc_init(cpu.irc, &cpu);
-	cpu_init(&cpu, memory);
-	cpu.registers[PC] = 0x7FFF000;
+	if (!cpu_init(&cpu, memory)) {
+		fprintf(stderr, "Failed to allocate the CPU state\n");
+		return 1;
+	}
+	cpu.engine = engine;
+	if (engine == ENGINE_JIT && !jit_init(&cpu)) {
+		fprintf(stderr, "JIT unavailable, using the threaded interpreter\n");
+		cpu.engine = ENGINE_THREADED;
+	}
+	/* hitting one pauses, p resumes from it */
+	for (uint8_t i = 0; i < nbreakpoints; i++)
+		cpu_toggle_breakpoint(&cpu, breakpoints[i]);
+	cpu.registers[PC] = BIOS_BASE;
 	cpu.registers[PPTR] = 0;
 	cpu.registers[IMR] = 0;
 	cpu.registers[ITR] = 0;
 
-	freopen("stderr.txt", "w", stderr);
-	setvbuf(stderr, nullptr, _IONBF, 0);
-
-	fb_mem = calloc(1, FB_SIZE);
+	fb_mem = calloc(1, FB_MAP_SIZE);
 	if (!fb_mem) {
 		fprintf(stderr, "Failed to allocate framebuffer\n");
 		return 1;
 	}
-	static struct mmio_hook fb_hook = {.base = FB_BASE,
-									   .size = FB_SIZE,
-									   .read = fb_mmio_read,
-									   .write = fb_mmio_write,
-									   .next = nullptr};
-	register_mmio_hook(&fb_hook);
+	fb_hook.ram = fb_mem;
+	if (!register_mmio_hook(&fb_hook)) {
+		perror("framebuffer");
+		return 1;
+	}
+	damage_whole_fb();
 	static struct mmio_hook kbd_hook = {
 		.base = KBD_BASE,
 		.size = KBD_SIZE,
 		.read = kbd_mmio_read,
 		.write = kbd_mmio_write,
+		.overlay = true, /* the BIOS expects it inside the framebuffer */
 		.next = nullptr,
 	};
-	register_mmio_hook(&kbd_hook);
+	if (!register_mmio_hook(&kbd_hook) ||
+		!display_init(FB_HEIGHT * FB_PITCH) || !blit_init() || !timer_init()) {
+		perror("Failed to map device registers");
+		return 1;
+	}
+	if (disk != nullptr && !blk_init(&cpu, disk, batch)) {
+		perror(disk);
+		return 1;
+	}
+
+	static struct snapshot_dev snap_devs[] = {
+		{.name = "fb", .size = FB_SIZE},
+		{.name = "kbd.buf",
+		 .data = kbd_buf,
+		 .size = sizeof kbd_buf,
+		 .lock = &kbd_mtx},
+		{.name = "kbd.head",
+		 .data = &kbd_head,
+		 .size = sizeof kbd_head,
+		 .lock = &kbd_mtx},
+		{.name = "kbd.tail",
+		 .data = &kbd_tail,
+		 .size = sizeof kbd_tail,
+		 .lock = &kbd_mtx},
+	};
+	snap_devs[0].data = fb_mem;
+	for (size_t i = 0; i < sizeof snap_devs / sizeof *snap_devs; i++)
+		snapshot_register(&snap_devs[i]);
+	if (restore && !restore_snapshot(&cpu))
+		return 1;
+
+	/* headless, see batch.h */
+	if (batch) {
+		if (!batch_init()) {
+			perror("batch");
+			return 1;
+		}
+		return batch_run(&cpu, step_limit);
+	}
+
+	freopen("stderr.txt", "w", stderr);
+	setvbuf(stderr, nullptr, _IONBF, 0);
 
 	if (SDL_Init(SDL_INIT_VIDEO) != 0) {
 		fprintf(stderr, "SDL_Init: %s\n", SDL_GetError());
@@ -306,8 +638,8 @@ int main(int argc, char **argv) {
 	WINDOW *w_stack = newwin(top_h, right_w, 0, col_w * 3);
 	WINDOW *w_page = newwin(bot_h, right_w, top_h, col_w * 3);
 
-	struct core ui_core = {};
-	memcpy(&ui_core, &cpu, sizeof(struct core));
+	static struct cpu_snapshot ui_snap;
+	uint64_t ui_seq = 0;
 
 	pthread_t cpu_thread;
 	if (pthread_create(&cpu_thread, nullptr, cpu_thread_func, &cpu) != 0) {
@@ -320,6 +652,7 @@ int main(int argc, char **argv) {
 	clock_gettime(CLOCK_MONOTONIC, &next_frame);
 
 	bool show_sp0 = false;
+	bool exposed = true;
 
 	while (!safe_load_bool(&halted_global)) {
 	last_update:
@@ -334,6 +667,8 @@ int main(int argc, char **argv) {
 		while (SDL_PollEvent(&ev)) {
 			if (ev.type == SDL_QUIT) {
 				safe_store_bool(&halted_global, true);
+			} else if (ev.type == SDL_WINDOWEVENT) {
+				exposed = true;
 			} else if (ev.type == SDL_KEYDOWN) {
 				if (!safe_load_bool(&paused)) {
 					SDL_Keycode sym = ev.key.keysym.sym;
@@ -341,9 +676,7 @@ int main(int argc, char **argv) {
 						uint8_t c = (uint8_t)sym;
 						kbd_buf[kbd_head++] = c;
 						kbd_head &= 255;
-						pthread_mutex_lock(&kbd_mtx);
-						kbd_pending = true;
-						pthread_mutex_unlock(&kbd_mtx);
+						cpu_post_irq(&cpu, ICR_KEYB);
 					}
 				}
 			}
@@ -352,54 +685,62 @@ int main(int argc, char **argv) {
 		int ch = getch();
 		if (ch == 'q')
 			safe_store_bool(&halted_global, true);
-		else if (ch == 'p')
-			safe_store_bool(&paused, !safe_load_bool(&paused));
-		else if (ch == 't')
+		else if (ch == 'p') {
+			bool pause = !safe_load_bool(&paused);
+			safe_store_bool(&paused, pause);
+			if (pause)
+				cpu_request(&cpu, CPU_REQ_PAUSE);
+		} else if (ch == 't')
 			show_sp0 = !show_sp0;
-
-		if (safe_load_bool(&snapshot_ready)) {
-			pthread_mutex_lock(&snap_mtx);
-			memcpy(ui_core.registers, latest_snapshot.regs,
-				   sizeof ui_core.registers);
-			safe_store_bool(&snapshot_ready, false);
-			pthread_mutex_unlock(&snap_mtx);
+		else if (ch == 's')
+			cpu_request(&cpu, CPU_REQ_SAVE);
+		else if (ch == 'r')
+			cpu_request(&cpu, CPU_REQ_RESTORE);
+
+		read_snapshot(&ui_snap, &ui_seq);
+		atomic_store_explicit(&snapshot_wanted, true, memory_order_relaxed);
+
+		/* once the guest flips, only flipped frames are uploaded */
+		const uint8_t *frame;
+		bool shown;
+		if (display_vsync(&cpu, !safe_load_bool(&paused), &frame)) {
+			shown = frame != nullptr;
+			if (shown)
+				SDL_UpdateTexture(sdl_texture, nullptr, frame, FB_PITCH);
+		} else {
+			shown = upload_fb_damage();
+			atomic_store_explicit(&fb_wanted, true, memory_order_relaxed);
+		}
+		if (shown || exposed) {
+			SDL_RenderClear(sdl_renderer);
+			SDL_RenderCopy(sdl_renderer, sdl_texture, nullptr, nullptr);
+			SDL_RenderPresent(sdl_renderer);
+			exposed = false;
 		}
-
-		SDL_UpdateTexture(sdl_texture, nullptr, fb_mem, FB_PITCH);
-		SDL_RenderClear(sdl_renderer);
-		SDL_RenderCopy(sdl_renderer, sdl_texture, nullptr, nullptr);
-		SDL_RenderPresent(sdl_renderer);
 
 		werase(w_inst);
 		box(w_inst, 0, 0);
 		mvwprintw(w_inst, 0, 2, " Disassembly ");
 		{
 			int rows = H - 2;
-			uint64_t pc = ui_core.registers[PC];
-			uint64_t addr = pc;
-			struct instruction inst;
+			uint64_t pc = ui_snap.regs[PC];
 			char linebuf[128];
 
-			for (int i = 0; i < rows; i++) {
-				uint64_t cur = addr;
-				uint64_t next = parse_instruction_ro(&ui_core, &inst, addr);
+			for (int i = 0; i < rows && i < SNAP_INSTS; i++) {
+				struct snap_inst *si = &ui_snap.insts[i];
+				uint64_t cur = si->pc;
 
-				if (next == 0) {
-					uint8_t b = vread8(&ui_core, addr);
+				if (!si->valid)
 					snprintf(linebuf, sizeof linebuf,
-							 "%016" PRIx64 ": [0x%02" PRIx8 "]", cur, b);
-					next = addr + 1;
-				} else {
-					format_inst(&inst, cur, linebuf, sizeof linebuf);
-				}
+							 "%016" PRIx64 ": [0x%02" PRIx8 "]", cur, si->byte);
+				else
+					format_inst(&si->inst, cur, linebuf, sizeof linebuf);
 
 				if (cur == pc)
 					wattron(w_inst, A_REVERSE);
 				mvwprintw(w_inst, 1 + i, 1, "%.*s", col_w - 2, linebuf);
 				if (cur == pc)
 					wattroff(w_inst, A_REVERSE);
-
-				addr = next;
 			}
 		}
 		wrefresh(w_inst);
@@ -443,7 +784,7 @@ int main(int argc, char **argv) {
 					int idx = c * per + r;
 					if (idx >= 41)
 						break;
-					uint64_t v = ui_core.registers[idx];
+					uint64_t v = ui_snap.regs[idx];
 					int y = 1 + r;
 					int x = 1 + c * col_wd;
 					if (idx == PC)
@@ -466,19 +807,19 @@ int main(int argc, char **argv) {
 			if (bpr < 1)
 				bpr = 1;
 			int mrows = H - 2;
-			uint64_t base = ui_core.registers[PC] > (bpr * 2)
-								? ui_core.registers[PC] - (bpr * 2)
+			uint64_t base = ui_snap.regs[PC] > (bpr * 2)
+								? ui_snap.regs[PC] - (bpr * 2)
 								: 0;
 			for (int r = 0; r < mrows; r++) {
 				uint64_t a = base + r * bpr;
 				mvwprintw(w_mem, 1 + r, 1, "%016" PRIx64 ":", a);
 				for (uint64_t b = 0; b < bpr; b++) {
-					LOCK_MEM_READ();
-					uintptr_t phys =
-						vaddr_to_phys(&ui_core, a + b); // TODO manually lock
-					uint8_t byte = ui_core.mem->mem[phys];
-					UNLOCK_MEM();
-					mvwprintw(w_mem, 1 + r, 19 + b * 3, "%02" PRIx8, byte);
+					uint64_t off = a + b - ui_snap.mem_base;
+					if (a + b < ui_snap.mem_base || off >= ui_snap.mem_len)
+						mvwprintw(w_mem, 1 + r, 19 + b * 3, "??");
+					else
+						mvwprintw(w_mem, 1 + r, 19 + b * 3, "%02" PRIx8,
+								  ui_snap.mem[off]);
 				}
 			}
 		}
@@ -503,10 +844,15 @@ int main(int argc, char **argv) {
 
 		{
 			int srows = top_h - 2;
-			uint64_t sp = ui_core.registers[show_sp0 ? SP0 : SP1];
+			uint64_t sp = ui_snap.regs[show_sp0 ? SP0 : SP1];
 			for (int i = 0; i < srows; i++) {
 				uint64_t a = sp + i * sizeof(uint64_t);
-				uint64_t v = vread64(&ui_core, a);
+				uint64_t v;
+				if ((i + 1) * sizeof v > ui_snap.stack_len[show_sp0]) {
+					mvwprintw(w_stack, 1 + i, 1, "%016" PRIx64 ":??", a);
+					continue;
+				}
+				memcpy(&v, ui_snap.stack[show_sp0] + i * sizeof v, sizeof v);
 				mvwprintw(w_stack, 1 + i, 1, "%016" PRIx64 ":%016" PRIx64, a,
 						  v);
 			}
@@ -518,13 +864,11 @@ int main(int argc, char **argv) {
 		mvwprintw(w_page, 0, 2, "Page");
 		{
 			int prow = bot_h - 2;
-			uint64_t base = ui_core.registers[PC] & ~0xFFF;
-			for (int i = 0; i < prow; i++) {
+			uint64_t base = ui_snap.regs[PC] & ~0xFFF;
+			for (int i = 0; i < prow && i < SNAP_PAGES; i++) {
 				uint64_t va = base + i * 0x1000;
-				LOCK_MEM_READ();
-				uintptr_t pa = vaddr_to_phys_u(&ui_core, va, false);
-				UNLOCK_MEM();
-				if (pa == 0)
+				uintptr_t pa = ui_snap.pages[i];
+				if (!ui_snap.page_ok[i])
 					mvwprintw(w_page, 1 + i, 1, "%016" PRIx64 "-> FAULT", va);
 				else
 					mvwprintw(w_page, 1 + i, 1, "%016" PRIx64 "-> %016" PRIxPTR,
@@ -16,8 +16,9 @@
 		int (*eq)(K, K);                                                       \
 	}
 
+/* false if the tables can't be allocated */
 #define map_init(map, hashfunc, eqfunc)                                        \
-	do {                                                                       \
+	({                                                                         \
 		(map)->capacity = 16;                                                  \
 		(map)->size = 0;                                                       \
 		(map)->keys = malloc((map)->capacity * sizeof(*(map)->keys));          \
@@ -27,7 +28,7 @@
 		(map)->eq = eqfunc;                                                    \
 		(map)->keys != nullptr && (map)->values != nullptr &&                  \
 			(map)->states != nullptr;                                          \
-	} while (0)
+	})
 
 #define map_clear(map)                                                         \
 	do {                                                                       \
@@ -1,14 +1,85 @@
 #include <cpu.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <mmio.h>
 #include <paging.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 static struct mmio_hook *mmio_hooks = nullptr;
 
-void register_mmio_hook(struct mmio_hook *h) {
+struct mmio_hook **phys_map[PHYS_REGIONS];
+uintptr_t phys_ram_size = 0;
+
+void phys_map_ram(uintptr_t size) { phys_ram_size = size; }
+
+static struct mmio_hook **page_slot(uintptr_t paddr, bool create) {
+	uintptr_t region = paddr >> PHYS_REGION_SHIFT;
+	if (region >= PHYS_REGIONS)
+		return nullptr;
+	if (phys_map[region] == nullptr) {
+		if (!create)
+			return nullptr;
+		phys_map[region] = calloc(PHYS_REGION_PAGES, sizeof **phys_map);
+		if (phys_map[region] == nullptr)
+			return nullptr;
+	}
+	return &phys_map[region][(paddr >> 12) & (PHYS_REGION_PAGES - 1)];
+}
+
+/* recomputes the slot of one page from the hook list, false if a hook is left
+ * without one */
+static bool remap_page(uintptr_t page) {
+	struct mmio_hook *owner = nullptr;
+	for (struct mmio_hook *h = mmio_hooks; h; h = h->next) {
+		if (page < h->base + h->size && h->base < page + 0x1000)
+			owner = owner == nullptr ? h : MMIO_SHARED;
+	}
+
+	struct mmio_hook **slot = page_slot(page, owner != nullptr);
+	if (slot == nullptr)
+		return owner == nullptr;
+	*slot = owner;
+	return true;
+}
+
+static bool remap_hook(struct mmio_hook *h) {
+	if (h->size == 0)
+		return true;
+	bool ok = true;
+	uintptr_t first = h->base & ~0xFFFULL;
+	uintptr_t last = (h->base + h->size - 1) & ~0xFFFULL;
+	for (uintptr_t page = first; page <= last; page += 0x1000)
+		ok &= remap_page(page);
+	return ok;
+}
+
+static bool hooks_overlap(const struct mmio_hook *a,
+						  const struct mmio_hook *b) {
+	return a->base < b->base + b->size && b->base < a->base + a->size;
+}
+
+bool register_mmio_hook(struct mmio_hook *h) {
+	if (h->size > (1ULL << PHYS_BITS) ||
+		h->base > (1ULL << PHYS_BITS) - h->size) {
+		errno = EINVAL;
+		return false;
+	}
+	for (struct mmio_hook *o = mmio_hooks; o; o = o->next) {
+		if (hooks_overlap(h, o) && h->overlay == o->overlay) {
+			errno = EEXIST;
+			return false;
+		}
+	}
 	h->next = mmio_hooks;
 	mmio_hooks = h;
+	if (!remap_hook(h)) {
+		unregister_mmio_hook(h);
+		errno = ENOMEM;
+		return false;
+	}
+	return true;
 }
 
 bool unregister_mmio_hook(struct mmio_hook *h) {
@@ -17,6 +88,7 @@ bool unregister_mmio_hook(struct mmio_hook *h) {
 		if (*prev == h) {
 			*prev = h->next;
 			h->next = nullptr;
+			remap_hook(h);
 			return true;
 		}
 		prev = &(*prev)->next;
@@ -24,24 +96,99 @@ bool unregister_mmio_hook(struct mmio_hook *h) {
 	return false;
 }
 
-bool handle_mmio_read(struct core *c, uintptr_t paddr, void *buf, size_t len) {
-	struct mmio_hook *hook = NULL;
+bool mmio_overlaps(uintptr_t paddr, size_t len) {
+	if (len == 0)
+		return false;
+	for (uintptr_t page = paddr & ~0xFFFULL; page <= paddr + len - 1;
+		 page += 0x1000) {
+		if (phys_page_hook(page) != nullptr)
+			return true;
+	}
+	return false;
+}
 
-	for (hook = mmio_hooks; hook; hook = hook->next) {
-		if (paddr >= hook->base && paddr + len <= hook->base + hook->size) {
-			uintptr_t offset = paddr - hook->base;
-			return hook->read(c, offset, buf, len);
+static struct mmio_hook *find_hook(uintptr_t paddr, size_t len) {
+	struct mmio_hook *h = phys_page_hook(paddr);
+	if (h == nullptr)
+		return nullptr;
+	if (h != MMIO_SHARED) {
+		if (paddr >= h->base && paddr + len <= h->base + h->size)
+			return h;
+		return nullptr;
+	}
+
+	struct mmio_hook *found = nullptr;
+	for (h = mmio_hooks; h; h = h->next) {
+		if (paddr >= h->base && paddr + len <= h->base + h->size) {
+			if (h->overlay)
+				return h;
+			found = h;
 		}
 	}
+	return found;
+}
 
-	return false;
+uint8_t *mmio_page_host(uintptr_t paddr, bool write) {
+	struct mmio_hook *h = phys_page_hook(paddr);
+	if (h == nullptr || h == MMIO_SHARED || h->ram == nullptr)
+		return nullptr;
+	const uintptr_t page = (paddr - h->base) >> 12;
+	if (write && !(h->damage[page >> 6] & (1ull << (page & 63))))
+		return nullptr;
+	return h->ram + (page << 12);
+}
+
+void mmio_damage(struct core *c, struct mmio_hook *h, uintptr_t offset,
+				 size_t len) {
+	for (uintptr_t p = offset >> 12; p <= (offset + len - 1) >> 12; p++) {
+		const uint64_t bit = 1ull << (p & 63);
+		if (h->damage[p >> 6] & bit)
+			continue;
+		h->damage[p >> 6] |= bit;
+		/* let the next store have the host pointer */
+		tlb_flush_page_writes(c, h->base + (p << 12));
+	}
+}
+
+void mmio_damage_collect(struct core *c, struct mmio_hook *h, uint64_t *out) {
+	bool any = false;
+	for (size_t i = 0; i < ((h->size >> 12) + 63) / 64; i++) {
+		out[i] |= h->damage[i];
+		any |= h->damage[i] != 0;
+		h->damage[i] = 0;
+	}
+	if (!any)
+		return;
+
+	/* clean again, stores have to come back through mmio_damage() */
+	for (int i = 0; i < TLB_ENTRIES; i++) {
+		struct tlb_entry *e = &c->tlb.entries[TLB_WRITE][i];
+		if (e->vpage != TLB_INVALID && e->ppage >= h->base &&
+			e->ppage < h->base + h->size)
+			e->vpage = TLB_INVALID;
+	}
+}
+
+bool handle_mmio_read(struct core *c, uintptr_t paddr, void *buf, size_t len) {
+	struct mmio_hook *hook = find_hook(paddr, len);
+	if (hook == nullptr)
+		return false;
+	if (hook->ram != nullptr) {
+		memcpy(buf, hook->ram + (paddr - hook->base), len);
+		return true;
+	}
+	return hook->read(c, paddr - hook->base, buf, len);
 }
 
 bool handle_mmio_write(struct core *c, uintptr_t addr, const void *buf,
 					   size_t len) {
-	for (struct mmio_hook *h = mmio_hooks; h; h = h->next) {
-		if (addr >= h->base && addr + len <= h->base + h->size)
-			return h->write(c, addr - h->base, buf, len);
+	struct mmio_hook *h = find_hook(addr, len);
+	if (h == nullptr)
+		return false;
+	if (h->ram != nullptr) {
+		memcpy(h->ram + (addr - h->base), buf, len);
+		mmio_damage(c, h, addr - h->base, len);
+		return true;
 	}
-	return false;
+	return h->write(c, addr - h->base, buf, len);
 }
@@ -17,12 +17,70 @@ struct mmio_hook {
 	size_t size;
 	mmio_read_fn read;
 	mmio_write_fn write;
+	/* may sit on top of part of one plain hook, which loses those bytes to
+	 * it. only the keyboard does, inside the framebuffer */
+	bool overlay;
 	struct mmio_hook *next;
+	/* device memory the guest uses like RAM, read and write aren't called.
+	 * size is a multiple of 4 KiB and pages are mapped straight into the TLB,
+	 * a clean page keeps stores on the slow path until they set its bit in
+	 * damage, one per page from base */
+	uint8_t *ram;
+	uint64_t *damage;
 };
 
-void register_mmio_hook(struct mmio_hook *h);
+/* physical address space map, one slot per 4 KiB page split into 1 GiB
+ * regions, regions without devices aren't allocated */
+#define PHYS_BITS 40
+#define PHYS_REGION_SHIFT 30
+#define PHYS_REGIONS (1ULL << (PHYS_BITS - PHYS_REGION_SHIFT))
+#define PHYS_REGION_PAGES (1ULL << (PHYS_REGION_SHIFT - 12))
+
+enum phys_kind : uint8_t {
+	PHYS_UNMAPPED,
+	PHYS_RAM,
+	PHYS_MMIO,
+};
+
+/* slot value for pages shared by more than one hook */
+#define MMIO_SHARED ((struct mmio_hook *)1)
+
+extern struct mmio_hook **phys_map[PHYS_REGIONS];
+extern uintptr_t phys_ram_size;
+
+void phys_map_ram(uintptr_t size);
+
+static inline struct mmio_hook *phys_page_hook(uintptr_t paddr) {
+	uintptr_t region = paddr >> PHYS_REGION_SHIFT;
+	if (region >= PHYS_REGIONS || phys_map[region] == nullptr)
+		return nullptr;
+	return phys_map[region][(paddr >> 12) & (PHYS_REGION_PAGES - 1)];
+}
+
+static inline enum phys_kind phys_classify(uintptr_t paddr) {
+	if (phys_page_hook(paddr) != nullptr)
+		return PHYS_MMIO;
+	return paddr < phys_ram_size ? PHYS_RAM : PHYS_UNMAPPED;
+}
+
+/* false with errno set if h lies outside the physical address space, overlaps
+ * another hook or its pages can't be mapped */
+bool register_mmio_hook(struct mmio_hook *h);
 bool unregister_mmio_hook(struct mmio_hook *h);
 
+bool mmio_overlaps(uintptr_t paddr, size_t len);
+
+/* host memory behind a page of a RAM backed hook, nullptr if stores to it
+ * have to take the slow path */
+uint8_t *mmio_page_host(uintptr_t paddr, bool write);
+
+/* marks [offset, offset + len) of a RAM backed hook as stored to */
+void mmio_damage(struct core *c, struct mmio_hook *h, uintptr_t offset,
+				 size_t len);
+
+/* ORs the damage bits of h into out and clears them. CPU thread only */
+void mmio_damage_collect(struct core *c, struct mmio_hook *h, uint64_t *out);
+
 /* returns false if address is not handeled by MMIO */
 bool handle_mmio_read(struct core *c, uintptr_t paddr, void *buf, size_t len);
 bool handle_mmio_write(struct core *c, uintptr_t paddr, const void *buf,
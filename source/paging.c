@@ -1,118 +1,439 @@
+#include <bcache.h>
 #include <cpu.h>
 #include <err.h>
 #include <interrupt.h>
+#include <mmio.h>
 #include <paging.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/mman.h>
-#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-pthread_rwlock_t mem_rwlock = PTHREAD_RWLOCK_INITIALIZER;
-
-struct ram *init_memory(uintptr_t precomit) {
+struct ram *init_memory(uintptr_t size, enum ram_pages pages) {
 	struct ram *mem = malloc(sizeof *mem);
 
 	if (mem == nullptr)
 		return nullptr;
 
-	mem->mem = malloc(precomit * sizeof *mem->mem);
-	// mmap(nullptr, precomit, PROT_READ | PROT_WRITE, MAP_ANONYMOUS, -1, 0);
-
-	if (mem->mem == nullptr) {
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+	if (pages == RAM_PAGES_HUGETLB) {
+		flags |= MAP_HUGETLB;
+		size = (size + RAM_HUGE_PAGE - 1) & ~(RAM_HUGE_PAGE - 1);
+	}
+	mem->mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (mem->mem == MAP_FAILED) {
 		free(mem);
 		return nullptr;
 	}
-	mem->cap = precomit;
+	if (pages == RAM_PAGES_THP)
+		madvise(mem->mem, size, MADV_HUGEPAGE);
+
+	mem->cap = size;
+	mem->dirty = nullptr;
+	phys_map_ram(mem->cap);
 	return mem;
 }
 
-uintptr_t vaddr_to_phys(struct core *c, uintptr_t vaddr) {
-#define CHECK_PAGE                                                             \
-	if (entry->present == 0) {                                                 \
-		vm_error = VM_INT_PF;                                                  \
-		return 0;                                                              \
+bool load_image(struct ram *mem, const char *path, uintptr_t paddr) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return false;
+	}
+	const size_t size = st.st_size;
+	if (paddr > mem->cap || size > mem->cap - paddr) {
+		close(fd);
+		errno = EFBIG;
+		return false;
 	}
 
-	if (c->registers[PPTR] == 0)
-		return vaddr;
+	/* the tail of the last page past EOF reads as zero */
+	if ((paddr & 0xFFF) == 0 && size != 0 &&
+		mmap(mem->mem + paddr, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+		close(fd);
+		return true;
+	}
 
-	const uintptr_t l1_index = vaddr >> 51;
-	const uintptr_t l2_index = (vaddr >> 38) & 0b1111111111111;
-	const uintptr_t l3_index = (vaddr >> 25) & 0b1111111111111;
-	const uintptr_t l4_index = (vaddr >> 12) & 0b1111111111111;
-	const uintptr_t page_frame_index = vaddr & 0b111111111111;
+	/* hugetlb RAM or an unaligned base */
+	size_t done = 0;
+	while (done < size) {
+		ssize_t n = pread(fd, mem->mem + paddr + done, size - done, done);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			close(fd);
+			return false;
+		}
+		done += n;
+	}
+	close(fd);
+	return true;
+}
 
-	struct page_table *page_table;
-	struct page_table_entry *entry;
+bool ram_dirty_enable(struct core *c) {
+	struct ram *mem = c->mem;
+	if (mem->dirty != nullptr)
+		return true;
+	mem->dirty = calloc(((mem->cap >> 12) + 63) / 64, sizeof *mem->dirty);
+	if (mem->dirty == nullptr)
+		return false;
+	/* every page starts out clean */
+	for (int i = 0; i < TLB_ENTRIES; i++)
+		c->tlb.entries[TLB_WRITE][i].vpage = TLB_INVALID;
+	return true;
+}
 
-	page_table = (struct page_table *)c->mem->mem + c->registers[PPTR];
-	entry = &page_table->entries[l1_index];
-	CHECK_PAGE;
-	page_table = (struct page_table *)(c->mem->mem + entry->next_page);
+void ram_dirty_set(struct core *c, uintptr_t paddr, size_t len) {
+	for (uintptr_t p = paddr >> 12; p <= (paddr + len - 1) >> 12; p++) {
+		const uint64_t bit = 1ull << (p & 63);
+		_Atomic uint64_t *w = &c->mem->dirty[p >> 6];
+		if (atomic_load_explicit(w, memory_order_relaxed) & bit)
+			continue;
+		atomic_fetch_or_explicit(w, bit, memory_order_relaxed);
+		/* let the next store have the host pointer */
+		tlb_flush_page_writes(c, p << 12);
+	}
+}
 
-	entry = &page_table->entries[l2_index];
-	CHECK_PAGE;
-	page_table = (struct page_table *)(c->mem->mem + entry->next_page);
+void ram_dirty_collect(struct core *c, uintptr_t paddr, size_t npages,
+					   uint64_t *out) {
+	const uintptr_t first = paddr >> 12;
+	memset(out, 0, (npages + 63) / 64 * sizeof *out);
+	if (c->mem->dirty == nullptr)
+		return;
 
-	entry = &page_table->entries[l3_index];
-	CHECK_PAGE;
-	page_table = (struct page_table *)(c->mem->mem + entry->next_page);
+	bool any = false;
+	for (size_t i = 0; i < npages;) {
+		const uintptr_t p = first + i;
+		_Atomic uint64_t *w = &c->mem->dirty[p >> 6];
+		if ((p & 63) == 0 && npages - i >= 64) {
+			uint64_t bits =
+				atomic_exchange_explicit(w, 0, memory_order_relaxed);
+			out[i >> 6] |= bits << (i & 63);
+			if (i & 63)
+				out[(i >> 6) + 1] |= bits >> (64 - (i & 63));
+			any |= bits != 0;
+			i += 64;
+			continue;
+		}
+		const uint64_t bit = 1ull << (p & 63);
+		if (atomic_fetch_and_explicit(w, ~bit, memory_order_relaxed) & bit) {
+			out[i >> 6] |= 1ull << (i & 63);
+			any = true;
+		}
+		i++;
+	}
+	if (!any)
+		return;
 
-	entry = &page_table->entries[l4_index];
-	CHECK_PAGE;
-	page_table = (struct page_table *)(c->mem->mem + entry->next_page);
+	/* the collected pages are clean again, stores have to see that */
+	const uintptr_t lo = first << 12, hi = (first + npages) << 12;
+	for (int i = 0; i < TLB_ENTRIES; i++) {
+		struct tlb_entry *e = &c->tlb.entries[TLB_WRITE][i];
+		if (e->vpage != TLB_INVALID && e->ppage >= lo && e->ppage < hi)
+			e->vpage = TLB_INVALID;
+	}
+}
 
-	return page_table->entries[page_frame_index].next_page;
-#undef CHECK_PAGE
+void tlb_flush(struct tlb *tlb) {
+	for (int k = 0; k < TLB_KINDS; k++)
+		for (int i = 0; i < TLB_ENTRIES; i++)
+			tlb->entries[k][i].vpage = TLB_INVALID;
+	for (int i = 0; i < TLB_LARGE_ENTRIES; i++)
+		tlb->large[i].tag = TLB_INVALID;
+	for (int i = 0; i < PSC_ENTRIES; i++)
+		tlb->psc[i].tag = TLB_INVALID;
+	tlb->psc_watch = 0;
+	tlb->flushes++;
 }
 
-uintptr_t vaddr_to_phys_u(struct core *c, uintptr_t vaddr, bool write) {
-#define CHECK_PAGE                                                             \
-	if (entry->present == 0 || (entry->usermode == 0 && !supervisor)) {        \
-		vm_error = VM_INT_PF;                                                  \
-		irc_raise_interrupt(c->irc, ICR_PAGE_FAULT);                           \
-		return 0;                                                              \
-	}                                                                          \
-	if (!entry->write && write) {                                              \
-		vm_error = VM_INT_PF;                                                  \
-		irc_raise_interrupt(c->irc, ICR_PAGE_FAULT);                           \
-		return 0;                                                              \
-	}
-
-	if (c->registers[PPTR] == 0)
-		return vaddr;
-
-	const uintptr_t l1_index = vaddr >> 51;
-	const uintptr_t l2_index = (vaddr >> 38) & 0b1111111111111;
-	const uintptr_t l3_index = (vaddr >> 25) & 0b1111111111111;
-	const uintptr_t l4_index = (vaddr >> 12) & 0b1111111111111;
-	const uintptr_t page_frame_index = vaddr & 0b111111111111;
-
-	struct page_table *page_table;
-	struct page_table_entry *entry;
+static void tlb_flush_asid(struct tlb *tlb, uint64_t asid) {
+	for (int k = 0; k < TLB_KINDS; k++)
+		for (int i = 0; i < TLB_ENTRIES; i++)
+			if (tlb->entries[k][i].vpage >> 52 == asid)
+				tlb->entries[k][i].vpage = TLB_INVALID;
+	for (int i = 0; i < TLB_LARGE_ENTRIES; i++)
+		if (tlb->large[i].tag >> 52 == asid)
+			tlb->large[i].tag = TLB_INVALID;
+	for (int i = 0; i < PSC_ENTRIES; i++)
+		if (tlb->psc[i].tag >> 52 == asid)
+			tlb->psc[i].tag = TLB_INVALID;
+}
+
+void tlb_pptr_written(struct core *c) {
+	const uint64_t pptr = c->registers[PPTR];
+	c->registers[PPTR] = pptr & ~PPTR_KEEP;
+	c->tlb.asid = pptr & PPTR_ASID;
+	c->tlb.flushes++;
+	if (!(pptr & PPTR_KEEP))
+		tlb_flush_asid(&c->tlb, c->tlb.asid);
+}
+
+static bool psc_watches(const struct tlb *tlb, uintptr_t frame) {
+	if (!(tlb->psc_watch & (1ull << ((frame >> 12) & 63))))
+		return false;
+	for (int i = 0; i < PSC_ENTRIES; i++) {
+		const struct psc_entry *p = &tlb->psc[i];
+		if (p->tag == TLB_INVALID)
+			continue;
+		for (int l = 0; l < 3; l++)
+			if (p->pages[l] == frame)
+				return true;
+	}
+	return false;
+}
+
+/* the TLB itself keeps its entries until PPTR is written, like before */
+void psc_drop(struct core *c, uintptr_t paddr, size_t len) {
+	if (!psc_watches(&c->tlb, paddr & ~0xFFFULL) &&
+		!psc_watches(&c->tlb, (paddr + len - 1) & ~0xFFFULL))
+		return;
+	for (int i = 0; i < PSC_ENTRIES; i++)
+		c->tlb.psc[i].tag = TLB_INVALID;
+	c->tlb.psc_watch = 0;
+}
+
+void tlb_flush_page_writes(struct core *c, uintptr_t paddr) {
+	for (int i = 0; i < TLB_ENTRIES; i++) {
+		struct tlb_entry *e = &c->tlb.entries[TLB_WRITE][i];
+		if (e->vpage != TLB_INVALID && e->ppage == (paddr & ~0xFFFULL))
+			e->vpage = TLB_INVALID;
+	}
+}
+
+static void psc_fill(struct core *c, struct psc_entry *p, uint64_t tag,
+					 uintptr_t table, const uintptr_t pages[3],
+					 const struct tlb_entry *e) {
+	p->tag = tag;
+	p->table = table;
+	p->usermode = e->usermode;
+	p->write = e->write;
+	p->execute = e->execute;
+	for (int l = 0; l < 3; l++) {
+		p->pages[l] = pages[l];
+		c->tlb.psc_watch |= 1ull << ((pages[l] >> 12) & 63);
+		/* stores to the tables have to reach psc_note_write() */
+		tlb_flush_page_writes(c, pages[l]);
+	}
+}
+
+static void tlb_large_fill(struct tlb *tlb, uintptr_t vaddr, int shift,
+						   uintptr_t pbase, const struct tlb_entry *e) {
+	struct tlb_large *l = &tlb->large[tlb->large_next++ % TLB_LARGE_ENTRIES];
+	l->tag = tlb_tag(tlb, vaddr >> shift);
+	l->pbase = pbase;
+	l->shift = shift;
+	l->usermode = e->usermode;
+	l->write = e->write;
+	l->execute = e->execute;
+}
+
+static bool tlb_large_lookup(const struct tlb *tlb, uintptr_t vaddr,
+							 struct tlb_entry *e) {
+	for (int i = 0; i < TLB_LARGE_ENTRIES; i++) {
+		const struct tlb_large *l = &tlb->large[i];
+		if (l->tag == TLB_INVALID || l->tag != tlb_tag(tlb, vaddr >> l->shift))
+			continue;
+		e->ppage = l->pbase | (vaddr & ((1ull << l->shift) - 1) & ~0xFFFULL);
+		e->usermode = l->usermode;
+		e->write = l->write;
+		e->execute = l->execute;
+		return true;
+	}
+	return false;
+}
 
+/* 4 level walk, the level 4 entry holds the physical frame unless a level 2
+ * or 3 entry is large. the first three levels come from the paging-structure
+ * cache when it has them */
+static bool page_walk(struct core *c, uintptr_t vaddr, struct tlb_entry *e) {
+	const uintptr_t index[4] = {
+		vaddr >> 51,
+		(vaddr >> 38) & 0b1111111111111,
+		(vaddr >> 25) & 0b1111111111111,
+		(vaddr >> 12) & 0b1111111111111,
+	};
+
+	uintptr_t table = c->registers[PPTR] & ~PPTR_ASID;
+	e->usermode = e->write = e->execute = true;
+
+	if (table == 0) {
+		e->ppage = vaddr & ~0xFFFULL;
+		return true;
+	}
+	if (tlb_large_lookup(&c->tlb, vaddr, e))
+		return true;
+
+	const uint64_t tag = tlb_tag(&c->tlb, vaddr >> 25);
+	struct psc_entry *p =
+		&c->tlb.psc[((vaddr >> 25) ^ c->tlb.asid) & (PSC_ENTRIES - 1)];
+	int level = 0;
+	if (p->tag == tag) {
+		table = p->table;
+		e->usermode = p->usermode;
+		e->write = p->write;
+		e->execute = p->execute;
+		level = 3;
+	}
+
+	uintptr_t pages[3];
+	for (; level < 4; level++) {
+		if (table > c->mem->cap - sizeof(struct page_table))
+			return false;
+		struct page_table *page_table =
+			(struct page_table *)(c->mem->mem + table);
+		struct page_table_entry *entry = &page_table->entries[index[level]];
+		if (entry->present == 0)
+			return false;
+		e->usermode &= entry->usermode;
+		e->write &= entry->write;
+		e->execute &= entry->execute;
+		if (level < 3)
+			pages[level] = (table + index[level] * sizeof *entry) & ~0xFFFULL;
+		table = entry->next_page;
+		if (entry->large && (level == 1 || level == 2)) {
+			const int shift = 12 + 13 * (3 - level);
+			const uintptr_t mask = (1ull << shift) - 1;
+			e->ppage = (table & ~mask) | (vaddr & mask & ~0xFFFULL);
+			tlb_large_fill(&c->tlb, vaddr, shift, table & ~mask, e);
+			return true;
+		}
+		if (level == 2)
+			psc_fill(c, p, tag, table, pages, e);
+	}
+
+	e->ppage = table & ~0xFFFULL;
+	return true;
+}
+
+static struct tlb_entry *tlb_lookup(struct core *c, uintptr_t vaddr,
+									enum tlb_access access) {
+	const uint64_t vpage = tlb_tag(&c->tlb, vaddr >> 12);
+	struct tlb_entry *e = tlb_slot(&c->tlb, vaddr >> 12, access);
+
+	if (e->vpage == vpage) {
+		c->tlb.hits++;
+		return e;
+	}
+	c->tlb.misses++;
+
+	if (!page_walk(c, vaddr, e)) {
+		e->vpage = TLB_INVALID;
+		return nullptr;
+	}
+	e->vpage = vpage;
+
+	/* only plain RAM and RAM backed devices get a host pointer. code pages,
+	 * clean tracked pages and cached page tables keep writes on the slow path
+	 * so the block cache, the dirty bitmap and the paging-structure cache see
+	 * them */
+	e->host = nullptr;
+	const enum phys_kind kind = phys_classify(e->ppage);
+	if (kind == PHYS_MMIO)
+		e->host = mmio_page_host(e->ppage, access == TLB_WRITE);
+	else if (kind == PHYS_RAM &&
+		e->ppage + 0x1000 <= c->mem->cap &&
+		(access != TLB_WRITE || (!bcache_is_code_page(c, e->ppage) &&
+								 !ram_page_clean(c->mem, e->ppage) &&
+								 !psc_watches(&c->tlb, e->ppage))))
+		e->host = c->mem->mem + e->ppage;
+	return e;
+}
+
+uintptr_t vaddr_translate(struct core *c, uintptr_t vaddr,
+						  enum tlb_access access) {
+	struct tlb_entry *e = tlb_lookup(c, vaddr, access);
+	if (e == nullptr) {
+		vm_error = VM_INT_PF;
+		return 0;
+	}
+	return e->ppage | (vaddr & 0xFFF);
+}
+
+uintptr_t vaddr_to_phys(struct core *c, uintptr_t vaddr) {
+	return vaddr_translate(c, vaddr, TLB_READ);
+}
+
+uintptr_t vaddr_to_phys_u(struct core *c, uintptr_t vaddr, bool write) {
 	bool supervisor = c->registers[PPR] == 0;
+	struct tlb_entry *e = tlb_lookup(c, vaddr, write ? TLB_WRITE : TLB_READ);
 
-	page_table = (struct page_table *)c->mem->mem + c->registers[PPTR];
-	entry = &page_table->entries[l1_index];
-	CHECK_PAGE;
-	page_table = (struct page_table *)(c->mem->mem + entry->next_page);
+	if (e == nullptr || (!e->usermode && !supervisor) || (write && !e->write)) {
+		vm_error = VM_INT_PF;
+		irc_raise_interrupt(c->irc, ICR_PAGE_FAULT);
+		return 0;
+	}
+	return e->ppage | (vaddr & 0xFFF);
+}
 
-	entry = &page_table->entries[l2_index];
-	CHECK_PAGE;
-	page_table = (struct page_table *)(c->mem->mem + entry->next_page);
+bool vfetch_slow(struct core *c, uintptr_t vaddr, void *buf, size_t len) {
+	struct tlb_entry *e = tlb_lookup(c, vaddr, TLB_READ);
+	if (e == nullptr)
+		return false;
+	if (e->host != nullptr) {
+		memcpy(buf, e->host + (vaddr & 0xFFF), len);
+		return true;
+	}
+
+	/* device or unbacked page, go byte by byte like the old decoder */
+	const uintptr_t paddr = e->ppage | (vaddr & 0xFFF);
+	uint8_t *out = buf;
+	for (size_t i = 0; i < len; i++) {
+		out[i] = 0;
+		if (!handle_mmio_read(c, paddr + i, &out[i], 1) &&
+			paddr + i < c->mem->cap)
+			out[i] = c->mem->mem[paddr + i];
+	}
+	return true;
+}
 
-	entry = &page_table->entries[l3_index];
-	CHECK_PAGE;
-	page_table = (struct page_table *)(c->mem->mem + entry->next_page);
+uint8_t *phys_dma_map(struct core *c, uintptr_t paddr, size_t len) {
+	if (paddr < c->mem->cap && len <= c->mem->cap - paddr &&
+		!mmio_overlaps(paddr, len))
+		return c->mem->mem + paddr;
+	struct mmio_hook *h = phys_page_hook(paddr);
+	if (h != nullptr && h != MMIO_SHARED && h->ram != nullptr &&
+		paddr >= h->base && len <= h->base + h->size - paddr)
+		return h->ram + (paddr - h->base);
+	return nullptr;
+}
 
-	entry = &page_table->entries[l4_index];
-	CHECK_PAGE;
-	page_table = (struct page_table *)(c->mem->mem + entry->next_page);
+void phys_dma_written(struct core *c, uintptr_t paddr, size_t len) {
+	if (len == 0)
+		return;
+	struct mmio_hook *h = phys_page_hook(paddr);
+	if (h != nullptr && h != MMIO_SHARED && h->ram != nullptr) {
+		mmio_damage(c, h, paddr - h->base, len);
+		return;
+	}
+	ram_note_write(c, paddr, len);
+	for (uintptr_t p = paddr & ~0xFFFULL; p < paddr + len; p += 0x1000)
+		psc_note_write(c, p, 1);
+	bcache_note_write(c, paddr, len);
+}
 
-	entry = &page_table->entries[page_frame_index];
-	CHECK_PAGE;
+size_t vpeek(struct core *c, uintptr_t vaddr, void *buf, size_t len) {
+	size_t done = 0;
 
-	return entry->next_page;
-#undef CHECK_PAGE
+	while (done < len) {
+		vm_error = VM_OK;
+		uintptr_t paddr = vaddr_translate(c, vaddr + done, TLB_READ);
+		size_t chunk = 0x1000 - ((vaddr + done) & 0xFFF);
+		if (chunk > len - done)
+			chunk = len - done;
+		if (vm_error != VM_OK || paddr + chunk > c->mem->cap ||
+			mmio_overlaps(paddr, chunk))
+			break;
+		memcpy((uint8_t *)buf + done, c->mem->mem + paddr, chunk);
+		done += chunk;
+	}
+	return done;
 }
 
 __PAGE_GENERATE_FOR_SIZES(__PAGE_GENERATE_FUNCTION_DEFINITIONS)
@@ -1,8 +1,8 @@
 #ifndef PAGEING_H
 #define PAGEING_H
 
+#include <cpu.h>
 #include <mmio.h>
-#include <pthread.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -13,29 +13,104 @@ struct [[gnu::packed]] page_table_entry {
 	uint8_t usermode : 1;
 	uint8_t write : 1;
 	uint8_t execute : 1;
-	uint8_t reserved : 4;
+	/* level 2 and 3 only, next_page is the base of a 256 GiB or 32 MiB
+	 * region mapped as one page */
+	uint8_t large : 1;
+	uint8_t reserved : 3;
 	uintptr_t next_page : 56;
 };
 
 struct [[gnu::packed]] page_table {
-	struct page_table_entry entries[1024];
+	struct page_table_entry entries[8192];
 };
 
 struct ram {
 	uint8_t *mem;
 	uintptr_t cap;
+	/* one bit per page written since it was last collected, nullptr until
+	 * someone calls ram_dirty_enable() */
+	_Atomic uint64_t *dirty;
 };
-extern pthread_rwlock_t mem_rwlock;
+/* guest RAM is owned by the CPU thread and accessed without locks. a device
+ * may also reach into it from its own threads through phys_dma_map(), but
+ * only into buffers the guest handed to it, e.g. a block request or a flipped
+ * frame. the buffer stays the device's until it reports the request done
+ * (used ring entry, vsync), the guest must leave it alone meanwhile. data a
+ * device wrote only counts once phys_dma_written() ran on the CPU thread */
 
-#define LOCK_MEM_READ() pthread_rwlock_rdlock(&mem_rwlock)
-#define LOCK_MEM_WRITE() pthread_rwlock_wrlock(&mem_rwlock)
-#define UNLOCK_MEM() pthread_rwlock_unlock(&mem_rwlock)
+enum ram_pages : uint8_t {
+	RAM_PAGES_SMALL,
+	RAM_PAGES_THP,	   /* ask for transparent huge pages */
+	RAM_PAGES_HUGETLB, /* explicit huge pages from the hugetlbfs pool */
+};
+
+#define RAM_HUGE_PAGE (2ull << 20)
+
+/* reserves size bytes of guest RAM, pages are committed on first touch */
+struct ram *init_memory(uintptr_t size, enum ram_pages pages);
+
+/* maps the file copy-on-write at paddr, falls back to reading it in when the
+ * RAM mapping can't be split. false with errno set on failure */
+bool load_image(struct ram *mem, const char *path, uintptr_t paddr);
+/* dirty page tracking. a clean page has no host pointer in the write TLB, so
+ * the first store to it takes the slow path and sets its bit, the ones after
+ * that run at full speed again */
+bool ram_dirty_enable(struct core *c);
+void ram_dirty_set(struct core *c, uintptr_t paddr, size_t len);
+
+/* copies the bits for npages pages starting at paddr into out, one per page
+ * from bit 0 of out[0], and clears them. CPU thread only */
+void ram_dirty_collect(struct core *c, uintptr_t paddr, size_t npages,
+					   uint64_t *out);
+
+static inline bool ram_page_clean(const struct ram *mem, uintptr_t paddr) {
+	const uintptr_t p = paddr >> 12;
+	return mem->dirty != nullptr &&
+		   !(atomic_load_explicit(&mem->dirty[p >> 6], memory_order_relaxed) &
+			 (1ull << (p & 63)));
+}
+
+static inline void ram_note_write(struct core *c, uintptr_t paddr,
+								  size_t len) {
+	if (c->mem->dirty != nullptr)
+		ram_dirty_set(c, paddr, len);
+}
+
+void tlb_flush(struct tlb *tlb);
+/* applies a write to PPTR, see PPTR_KEEP */
+void tlb_pptr_written(struct core *c);
+void psc_drop(struct core *c, uintptr_t paddr, size_t len);
+
+/* a store to a frame the paging-structure cache read from empties it */
+static inline void psc_note_write(struct core *c, uintptr_t paddr,
+								  size_t len) {
+	const uint64_t bits = 1ull << ((paddr >> 12) & 63) |
+						  1ull << (((paddr + len - 1) >> 12) & 63);
+	if (c->tlb.psc_watch & bits)
+		psc_drop(c, paddr, len);
+}
+void tlb_flush_page_writes(struct core *c, uintptr_t paddr);
 
-struct ram *init_memory(uintptr_t precomit);
 /* sets err to PAGE_FAULT on interrupt */
+uintptr_t vaddr_translate(struct core *c, uintptr_t vaddr,
+						  enum tlb_access access);
 uintptr_t vaddr_to_phys(struct core *c, uintptr_t vaddr);
 uintptr_t vaddr_to_phys_u(struct core *c, uintptr_t vaddr, bool write);
 
+/* host memory behind [paddr, paddr + len) for a device copying in or out,
+ * nullptr unless all of it is plain RAM or inside one RAM backed device.
+ * looks only at things fixed once the machine runs, so any thread can ask */
+uint8_t *phys_dma_map(struct core *c, uintptr_t paddr, size_t len);
+/* a device wrote to a range it got from phys_dma_map(), CPU thread only.
+ * call it before telling the guest the buffer is back, see struct ram */
+void phys_dma_written(struct core *c, uintptr_t paddr, size_t len);
+
+/* copies guest RAM without faulting or touching MMIO, stops at the first byte
+ * that isn't plain RAM and returns how many bytes were copied */
+size_t vpeek(struct core *c, uintptr_t vaddr, void *buf, size_t len);
+
+bool vfetch_slow(struct core *c, uintptr_t vaddr, void *buf, size_t len);
+
 #define vaddr_to_ptr(c, v) (vaddr_to_phys(c, v) + (c)->mem->mem)
 
 #define __PAGE_GENERATE_FOR_SIZES(_F)                                          \
@@ -44,73 +119,148 @@ uintptr_t vaddr_to_phys_u(struct core *c, uintptr_t vaddr, bool write);
 	_F(32)                                                                     \
 	_F(64)
 
+/* vaddr >> 12 leaves the top bits free for the ASID */
+static inline uint64_t tlb_tag(const struct tlb *tlb, uint64_t vpage) {
+	return vpage | tlb->asid << 52;
+}
+
+static inline struct tlb_entry *tlb_slot(struct tlb *tlb, uint64_t vpage,
+										 enum tlb_access access) {
+	return &tlb->entries[access][(vpage ^ tlb->asid) & (TLB_ENTRIES - 1)];
+}
+
+/* host pointer for an access that stays inside a cached plain RAM page,
+ * nullptr when the slow path has to handle it */
+static inline uint8_t *tlb_host(struct core *c, uintptr_t vaddr,
+								enum tlb_access access, size_t len) {
+	struct tlb_entry *e = tlb_slot(&c->tlb, vaddr >> 12, access);
+	if (e->vpage != tlb_tag(&c->tlb, vaddr >> 12) || e->host == nullptr ||
+		(vaddr & 0xFFF) + len > 0x1000)
+		return nullptr;
+	c->tlb.hits++;
+	return e->host + (vaddr & 0xFFF);
+}
+
+static inline uint8_t *tlb_host_u(struct core *c, uintptr_t vaddr,
+								  enum tlb_access access, size_t len) {
+	struct tlb_entry *e = tlb_slot(&c->tlb, vaddr >> 12, access);
+	if (e->vpage != tlb_tag(&c->tlb, vaddr >> 12) || e->host == nullptr ||
+		(vaddr & 0xFFF) + len > 0x1000)
+		return nullptr;
+	if ((!e->usermode && c->registers[PPR] != 0) ||
+		(access == TLB_WRITE && !e->write))
+		return nullptr;
+	c->tlb.hits++;
+	return e->host + (vaddr & 0xFFF);
+}
+
+/* copies instruction bytes from a single page with one translation, false if
+ * the page isn't mapped */
+static inline bool vfetch(struct core *c, uintptr_t vaddr, void *buf,
+						  size_t len) {
+	uint8_t *host = tlb_host(c, vaddr, TLB_READ, len);
+	if (host == nullptr)
+		return vfetch_slow(c, vaddr, buf, len);
+	memcpy(buf, host, len);
+	return true;
+}
+
 #define __PAGE_GENERATE_FUNCTION_DECLARATIONS(size)                            \
-	uint##size##_t vread##size(struct core *c, uintptr_t vaddr);               \
-	bool vwrite##size(struct core *c, uintptr_t vaddr, uint##size##_t val);    \
-	uint##size##_t vread##size##_u(struct core *c, uintptr_t vaddr);           \
-	bool vwrite##size##_u(struct core *c, uintptr_t vaddr, uint##size##_t val);
+	uint##size##_t vread##size##_slow(struct core *c, uintptr_t vaddr);        \
+	bool vwrite##size##_slow(struct core *c, uintptr_t vaddr,                  \
+							 uint##size##_t val);                              \
+	uint##size##_t vread##size##_u_slow(struct core *c, uintptr_t vaddr);      \
+	bool vwrite##size##_u_slow(struct core *c, uintptr_t vaddr,                \
+							   uint##size##_t val);                            \
+                                                                               \
+	static inline uint##size##_t vread##size(struct core *c,                   \
+											 uintptr_t vaddr) {                \
+		uint##size##_t ret;                                                    \
+		uint8_t *host = tlb_host(c, vaddr, TLB_READ, sizeof(ret));             \
+		if (host == nullptr)                                                   \
+			return vread##size##_slow(c, vaddr);                               \
+		memcpy(&ret, host, sizeof(ret));                                       \
+		return ret;                                                            \
+	}                                                                          \
+                                                                               \
+	static inline bool vwrite##size(struct core *c, uintptr_t vaddr,           \
+									uint##size##_t val) {                      \
+		uint8_t *host = tlb_host(c, vaddr, TLB_WRITE, sizeof(val));            \
+		if (host == nullptr)                                                   \
+			return vwrite##size##_slow(c, vaddr, val);                         \
+		memcpy(host, &val, sizeof(val));                                       \
+		return true;                                                           \
+	}                                                                          \
+                                                                               \
+	static inline uint##size##_t vread##size##_u(struct core *c,               \
+											   uintptr_t vaddr) {              \
+		uint##size##_t ret;                                                    \
+		uint8_t *host = tlb_host_u(c, vaddr, TLB_READ, sizeof(ret));           \
+		if (host == nullptr)                                                   \
+			return vread##size##_u_slow(c, vaddr);                             \
+		memcpy(&ret, host, sizeof(ret));                                       \
+		return ret;                                                            \
+	}                                                                          \
+                                                                               \
+	static inline bool vwrite##size##_u(struct core *c, uintptr_t vaddr,       \
+										uint##size##_t val) {                  \
+		uint8_t *host = tlb_host_u(c, vaddr, TLB_WRITE, sizeof(val));          \
+		if (host == nullptr)                                                   \
+			return vwrite##size##_u_slow(c, vaddr, val);                       \
+		memcpy(host, &val, sizeof(val));                                       \
+		return true;                                                           \
+	}
 
 #define __PAGE_GENERATE_FUNCTION_DEFINITIONS(size)                             \
-	uint##size##_t vread##size(struct core *c, uintptr_t vaddr) {              \
-		uint##size##_t ret;                                                    \
-		LOCK_MEM_READ();                                                       \
+	uint##size##_t vread##size##_slow(struct core *c, uintptr_t vaddr) {       \
+		uint##size##_t ret = 0;                                                \
 		uintptr_t paddr = vaddr_to_phys(c, vaddr);                             \
-		if (handle_mmio_read(c, paddr, &ret, sizeof(ret))) {                   \
-			UNLOCK_MEM();                                                      \
+		if (handle_mmio_read(c, paddr, &ret, sizeof(ret)))                     \
 			return ret;                                                        \
-		}                                                                      \
-		memcpy(&ret, c->mem->mem + paddr, sizeof(ret));                        \
-		UNLOCK_MEM();                                                          \
+		if (paddr + sizeof(ret) <= c->mem->cap)                                \
+			memcpy(&ret, c->mem->mem + paddr, sizeof(ret));                    \
 		return ret;                                                            \
 	}                                                                          \
                                                                                \
-	bool vwrite##size(struct core *c, uintptr_t vaddr, uint##size##_t val) {   \
-		LOCK_MEM_READ();                                                       \
-		uintptr_t paddr = vaddr_to_phys(c, vaddr);                             \
-		UNLOCK_MEM();                                                          \
-		LOCK_MEM_WRITE();                                                      \
-		if (handle_mmio_write(c, paddr, &val, sizeof(val))) {                  \
-			UNLOCK_MEM();                                                      \
+	bool vwrite##size##_slow(struct core *c, uintptr_t vaddr,                  \
+							 uint##size##_t val) {                             \
+		uintptr_t paddr = vaddr_translate(c, vaddr, TLB_WRITE);                \
+		if (handle_mmio_write(c, paddr, &val, sizeof(val)))                    \
 			return true;                                                       \
+		if (paddr + sizeof(val) <= c->mem->cap) {                              \
+			memcpy(c->mem->mem + paddr, &val, sizeof(val));                    \
+			ram_note_write(c, paddr, sizeof(val));                             \
+			psc_note_write(c, paddr, sizeof(val));                             \
+			bcache_note_write(c, paddr, sizeof(val));                          \
 		}                                                                      \
-		memcpy(c->mem->mem + paddr, &val, sizeof(val));                        \
-		UNLOCK_MEM();                                                          \
 		return true;                                                           \
 	}                                                                          \
                                                                                \
-	uint##size##_t vread##size##_u(struct core *c, uintptr_t vaddr) {          \
-		uint##size##_t ret;                                                    \
-		LOCK_MEM_READ();                                                       \
+	uint##size##_t vread##size##_u_slow(struct core *c, uintptr_t vaddr) {     \
+		uint##size##_t ret = 0;                                                \
 		uintptr_t off = vaddr_to_phys_u(c, vaddr, false);                      \
-		if (off == 0) {                                                        \
-			UNLOCK_MEM();                                                      \
+		if (off == 0)                                                          \
 			return 0;                                                          \
-		}                                                                      \
-		if (handle_mmio_read(c, off, &ret, sizeof(ret))) {                     \
-			UNLOCK_MEM();                                                      \
+		if (handle_mmio_read(c, off, &ret, sizeof(ret)))                       \
 			return ret;                                                        \
-		}                                                                      \
-		memcpy(&ret, c->mem->mem + off, sizeof(ret));                          \
-		UNLOCK_MEM();                                                          \
+		if (off + sizeof(ret) <= c->mem->cap)                                  \
+			memcpy(&ret, c->mem->mem + off, sizeof(ret));                      \
 		return ret;                                                            \
 	}                                                                          \
                                                                                \
-	bool vwrite##size##_u(struct core *c, uintptr_t vaddr,                     \
-						  uint##size##_t val) {                                \
-		LOCK_MEM_READ();                                                       \
+	bool vwrite##size##_u_slow(struct core *c, uintptr_t vaddr,                \
+							   uint##size##_t val) {                           \
 		uintptr_t off = vaddr_to_phys_u(c, vaddr, true);                       \
-		UNLOCK_MEM();                                                          \
-		LOCK_MEM_WRITE();                                                      \
-		if (off == 0) {                                                        \
-			UNLOCK_MEM();                                                      \
+		if (off == 0)                                                          \
 			return false;                                                      \
-		}                                                                      \
-		if (handle_mmio_write(c, off, &val, sizeof(val))) {                    \
-			UNLOCK_MEM();                                                      \
+		if (handle_mmio_write(c, off, &val, sizeof(val)))                      \
 			return true;                                                       \
+		if (off + sizeof(val) <= c->mem->cap) {                                \
+			memcpy(c->mem->mem + off, &val, sizeof(val));                      \
+			ram_note_write(c, off, sizeof(val));                               \
+			psc_note_write(c, off, sizeof(val));                               \
+			bcache_note_write(c, off, sizeof(val));                            \
 		}                                                                      \
-		memcpy(c->mem->mem + off, &val, sizeof(val));                          \
-		UNLOCK_MEM();                                                          \
 		return true;                                                           \
 	}
 
@@ -0,0 +1,291 @@
+#include <bcache.h>
+#include <cpu.h>
+#include <errno.h>
+#include <interrupt.h>
+#include <paging.h>
+#include <snapshot.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC "CPUSNAP2"
+
+struct snapshot_header {
+	char magic[8];
+	uint64_t ram_size;
+	uint64_t ram_offset; /* page aligned, RAM image runs to the end */
+	typeof(((struct core *)nullptr)->registers) registers;
+	uint64_t retired; /* the instruction clock events run on */
+	uint16_t irc_to_isr;
+	uint8_t in_exception;
+	uint8_t in_double_fault;
+	uint32_t nmasked; /* uint16_t vectors follow the header */
+	uint32_t ndevs;	  /* then name length, name, size, data for each */
+};
+
+static struct snapshot_dev *snapshot_devs = nullptr;
+
+void snapshot_register(struct snapshot_dev *dev) {
+	dev->next = snapshot_devs;
+	snapshot_devs = dev;
+}
+
+/* whatever the devices post while finishing is taken too, so it ends up in the
+ * image that is saved or the one that is thrown away */
+static void quiesce(struct core *c) {
+	for (struct snapshot_dev *d = snapshot_devs; d; d = d->next)
+		if (d->quiesce)
+			d->quiesce(c);
+	cpu_run_posted(c);
+}
+
+static bool write_all(int fd, const void *buf, size_t len, off_t off) {
+	const uint8_t *p = buf;
+	while (len > 0) {
+		ssize_t n = pwrite(fd, p, len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len, off_t off) {
+	uint8_t *p = buf;
+	while (len > 0) {
+		ssize_t n = pread(fd, p, len, off);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n == 0)
+				errno = EINVAL;
+			return false;
+		}
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return true;
+}
+
+/* appends to a growing buffer, out of memory is reported once at the end */
+struct out {
+	uint8_t *buf;
+	size_t len, cap;
+	bool failed;
+};
+
+static void put(struct out *o, const void *p, size_t len) {
+	if (o->failed)
+		return;
+	if (o->len + len > o->cap) {
+		size_t cap = o->cap ? o->cap : 4096;
+		while (cap < o->len + len)
+			cap *= 2;
+		uint8_t *buf = realloc(o->buf, cap);
+		if (buf == nullptr) {
+			o->failed = true;
+			return;
+		}
+		o->buf = buf;
+		o->cap = cap;
+	}
+	memcpy(o->buf + o->len, p, len);
+	o->len += len;
+}
+
+static bool page_is_zero(const uint8_t *page) {
+	const uint64_t *w = (const uint64_t *)page;
+	for (size_t i = 0; i < 0x1000 / sizeof *w; i++)
+		if (w[i] != 0)
+			return false;
+	return true;
+}
+
+/* pages the guest never touched stay holes in the file. mincore() lets
+ * resident pages skip the zero check, the rest may still be swapped out */
+static bool save_ram(struct ram *mem, int fd, off_t base) {
+	const size_t npages = mem->cap >> 12;
+	unsigned char *resident = malloc(npages);
+	if (resident == nullptr)
+		return false;
+	if (mincore(mem->mem, mem->cap, resident) < 0)
+		memset(resident, 0, npages);
+
+	bool ok = true;
+	size_t run = 0, start = 0;
+	for (size_t p = 0; p <= npages && ok; p++) {
+		if (p < npages &&
+			((resident[p] & 1) || !page_is_zero(mem->mem + (p << 12)))) {
+			if (run++ == 0)
+				start = p;
+			continue;
+		}
+		if (run != 0)
+			ok = write_all(fd, mem->mem + (start << 12), run << 12,
+						   base + (start << 12));
+		run = 0;
+	}
+	free(resident);
+	return ok;
+}
+
+bool snapshot_save(struct core *c, int fd) {
+	quiesce(c);
+	struct irc *irc = c->irc;
+	struct snapshot_header h = {
+		.magic = SNAPSHOT_MAGIC,
+		.ram_size = c->mem->cap,
+		.irc_to_isr = irc->irc_to_isr,
+		.in_exception = irc->in_exception,
+		.in_double_fault = irc->in_double_fault,
+		.nmasked = irc->masked_queue.size,
+	};
+	cpu_sync_flags(c);
+	memcpy(h.registers, c->registers, sizeof h.registers);
+	h.retired = c->retired;
+	for (struct snapshot_dev *d = snapshot_devs; d; d = d->next)
+		h.ndevs++;
+
+	struct out o = {};
+	put(&o, &h, sizeof h);
+	for (uint32_t i = 0; i < h.nmasked; i++)
+		put(&o, &irc->masked_queue.elements[irc->masked_queue.front + 1 + i].irc,
+			sizeof(uint16_t));
+	for (struct snapshot_dev *d = snapshot_devs; d; d = d->next) {
+		const uint32_t name_len = strlen(d->name);
+		const uint64_t size = d->size;
+		put(&o, &name_len, sizeof name_len);
+		put(&o, d->name, name_len);
+		put(&o, &size, sizeof size);
+		if (d->lock)
+			pthread_mutex_lock(d->lock);
+		put(&o, d->data, d->size);
+		if (d->lock)
+			pthread_mutex_unlock(d->lock);
+	}
+	if (o.failed) {
+		free(o.buf);
+		errno = ENOMEM;
+		return false;
+	}
+
+	h.ram_offset = (o.len + 0xFFF) & ~0xFFFULL;
+	memcpy(o.buf, &h, sizeof h);
+	bool ok = ftruncate(fd, 0) == 0 &&
+			  ftruncate(fd, h.ram_offset + h.ram_size) == 0 &&
+			  write_all(fd, o.buf, o.len, 0) &&
+			  save_ram(c->mem, fd, h.ram_offset);
+	free(o.buf);
+	return ok;
+}
+
+static struct snapshot_dev *find_dev(const char *name, size_t len) {
+	for (struct snapshot_dev *d = snapshot_devs; d; d = d->next)
+		if (strlen(d->name) == len && memcmp(d->name, name, len) == 0)
+			return d;
+	return nullptr;
+}
+
+/* checks the device records against what is registered, applying them only
+ * once everything matched */
+static bool load_devs(const uint8_t *p, const uint8_t *end, uint32_t ndevs,
+					  bool apply) {
+	for (uint32_t i = 0; i < ndevs; i++) {
+		uint32_t name_len;
+		uint64_t size;
+		if (end - p < (ptrdiff_t)sizeof name_len)
+			return false;
+		memcpy(&name_len, p, sizeof name_len);
+		p += sizeof name_len;
+		if ((size_t)(end - p) < name_len + sizeof size)
+			return false;
+		struct snapshot_dev *d = find_dev((const char *)p, name_len);
+		p += name_len;
+		memcpy(&size, p, sizeof size);
+		p += sizeof size;
+		if (d == nullptr || d->size != size || (uint64_t)(end - p) < size)
+			return false;
+		if (apply) {
+			if (d->lock)
+				pthread_mutex_lock(d->lock);
+			memcpy(d->data, p, size);
+			if (d->lock)
+				pthread_mutex_unlock(d->lock);
+		}
+		p += size;
+	}
+	return true;
+}
+
+bool snapshot_restore(struct core *c, int fd) {
+	struct snapshot_header h;
+	if (!read_all(fd, &h, sizeof h, 0))
+		return false;
+	if (memcmp(h.magic, SNAPSHOT_MAGIC, sizeof h.magic) != 0 ||
+		h.ram_size != c->mem->cap || h.ram_offset < sizeof h ||
+		(h.ram_offset & 0xFFF)) {
+		errno = EINVAL;
+		return false;
+	}
+
+	const size_t body_len = h.ram_offset - sizeof h;
+	uint8_t *body = malloc(body_len);
+	if (body == nullptr)
+		return false;
+	const uint8_t *end = body + body_len;
+	if (!read_all(fd, body, body_len, sizeof h)) {
+		free(body);
+		return false;
+	}
+	if (body_len < h.nmasked * sizeof(uint16_t) ||
+		!load_devs(body + h.nmasked * sizeof(uint16_t), end, h.ndevs, false)) {
+		free(body);
+		errno = EINVAL;
+		return false;
+	}
+
+	/* pages come in from the snapshot on first touch, the first store to one
+	 * gives this instance its own copy */
+	quiesce(c);
+	struct ram *mem = c->mem;
+	if (mmap(mem->mem, mem->cap, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_FIXED, fd, h.ram_offset) == MAP_FAILED &&
+		!read_all(fd, mem->mem, mem->cap, h.ram_offset)) {
+		free(body);
+		return false;
+	}
+	if (mem->dirty != nullptr)
+		for (size_t i = 0; i < ((mem->cap >> 12) + 63) / 64; i++)
+			atomic_store_explicit(&mem->dirty[i], ~0ull, memory_order_relaxed);
+
+	memcpy(c->registers, h.registers, sizeof h.registers);
+	c->retired = h.retired;
+	c->flags.op = FLAGS_NONE;
+	tlb_flush(&c->tlb);
+	tlb_pptr_written(c);
+	bcache_flush(c);
+
+	struct irc *irc = c->irc;
+	irc->irc_to_isr = h.irc_to_isr;
+	irc->in_exception = h.in_exception;
+	irc->in_double_fault = h.in_double_fault;
+	irc->masked_queue.size = 0;
+	irc->masked_queue.front = -1;
+	irc->masked_queue.back = 0;
+	for (uint32_t i = 0; i < h.nmasked; i++) {
+		struct interrupt_event e;
+		memcpy(&e.irc, body + i * sizeof(uint16_t), sizeof(uint16_t));
+		queue_push(&irc->masked_queue, e);
+	}
+
+	load_devs(body + h.nmasked * sizeof(uint16_t), end, h.ndevs, true);
+	free(body);
+	return true;
+}
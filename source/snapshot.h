@@ -0,0 +1,34 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct core;
+
+/* device state that lives outside struct core, saved as raw bytes in
+ * registration order */
+struct snapshot_dev {
+	const char *name;
+	void *data;
+	size_t size;
+	pthread_mutex_t *lock; /* held while copying, may be nullptr */
+	/* finishes what host threads are doing to guest RAM and the device,
+	 * called before saving and before RAM is replaced. may be nullptr */
+	void (*quiesce)(struct core *c);
+	struct snapshot_dev *next;
+};
+
+void snapshot_register(struct snapshot_dev *dev);
+
+/* the snapshot file is a header, the device state and a page aligned RAM image
+ * that leaves pages the guest never touched as holes. restoring maps the image
+ * copy-on-write over guest RAM, so it costs the same for any RAM size. that
+ * mapping keeps using the file, so never truncate or overwrite a snapshot
+ * that was restored from, write a new one and rename it over the old.
+ * both run on the CPU thread and return false with errno set on failure */
+bool snapshot_save(struct core *c, int fd);
+bool snapshot_restore(struct core *c, int fd);
+
+#endif // SNAPSHOT_H
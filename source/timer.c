@@ -0,0 +1,116 @@
+#include <cpu.h>
+#include <events.h>
+#include <mmio.h>
+#include <snapshot.h>
+#include <string.h>
+#include <timer.h>
+
+static struct {
+	uint64_t ctrl;
+	uint64_t interval;
+	uint64_t status;
+	uint64_t count;
+	uint64_t when; /* next expiry on the selected clock */
+} regs;
+
+static void fire(struct core *c, struct event *e);
+static struct event tick = {.fn = fire};
+
+static enum event_clock clock_of(void) {
+	return regs.ctrl & TIMER_CTRL_HOST ? EVENT_HOST : EVENT_INSNS;
+}
+
+static void arm(struct core *c, uint64_t when) {
+	event_cancel(c, &tick);
+	if (!(regs.ctrl & TIMER_CTRL_ENABLE) || regs.interval == 0)
+		return;
+	tick.clock = clock_of();
+	event_at(c, &tick, when);
+	regs.when = tick.when;
+}
+
+static void fire(struct core *c, struct event *) {
+	regs.status |= TIMER_STATUS_FIRED;
+	regs.count++;
+	if (regs.ctrl & TIMER_CTRL_IRQ)
+		cpu_post_irq(c, ICR_TIMER);
+	if (regs.ctrl & TIMER_CTRL_PERIODIC)
+		arm(c, regs.when + regs.interval);
+	else
+		regs.ctrl &= ~TIMER_CTRL_ENABLE;
+}
+
+static bool timer_read(struct core *c, uintptr_t offset, void *buf,
+					   size_t len) {
+	memset(buf, 0, len);
+	if (len != 8)
+		return true;
+	uint64_t v;
+	switch (offset) {
+	case TIMER_REG_NOW:
+		v = event_now(c, clock_of());
+		break;
+	case TIMER_REG_CTRL:
+		v = regs.ctrl;
+		break;
+	case TIMER_REG_INTERVAL:
+		v = regs.interval;
+		break;
+	case TIMER_REG_STATUS:
+		v = regs.status;
+		break;
+	case TIMER_REG_COUNT:
+		v = regs.count;
+		break;
+	default:
+		return true;
+	}
+	memcpy(buf, &v, sizeof v);
+	return true;
+}
+
+static bool timer_write(struct core *c, uintptr_t offset, const void *buf,
+						size_t len) {
+	if (len != 8)
+		return true;
+	uint64_t v;
+	memcpy(&v, buf, sizeof v);
+	if (offset == TIMER_REG_CTRL) {
+		regs.ctrl = v;
+	} else if (offset == TIMER_REG_INTERVAL) {
+		regs.interval = v;
+	} else {
+		if (offset == TIMER_REG_STATUS)
+			regs.status &= ~v;
+		return true;
+	}
+	arm(c, event_now(c, clock_of()) + regs.interval);
+	return true;
+}
+
+bool timer_init(void) {
+	static struct mmio_hook hook = {
+		.base = TIMER_BASE,
+		.size = TIMER_SIZE,
+		.read = timer_read,
+		.write = timer_write,
+		.next = nullptr,
+	};
+	static struct snapshot_dev dev = {
+		.name = "timer",
+		.data = &regs,
+		.size = sizeof regs,
+	};
+	if (!register_mmio_hook(&hook))
+		return false;
+	snapshot_register(&dev);
+	return true;
+}
+
+void timer_restored(struct core *c) {
+	/* host time moved on, only the instruction clock can carry on exactly */
+	if (clock_of() == EVENT_HOST)
+		arm(c, event_now(c, EVENT_HOST) + regs.interval);
+	else
+		arm(c, regs.when);
+}
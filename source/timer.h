@@ -0,0 +1,37 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+struct core;
+
+/* programmable interval timer on IRC0. it counts retired instructions, which
+ * gives the same ticks every run, or host nanoseconds with TIMER_CTRL_HOST.
+ * writing CTRL or INTERVAL starts it over from now if it is enabled. a one
+ * shot timer clears TIMER_CTRL_ENABLE when it fires, a periodic one keeps its
+ * phase unless it falls a whole period behind */
+#define TIMER_BASE 0x90250000UL
+#define TIMER_SIZE 0x28
+
+/* guest visible registers, all 8 bytes wide */
+#define TIMER_REG_NOW 0x00		/* R: the selected clock */
+#define TIMER_REG_CTRL 0x08		/* RW: TIMER_CTRL_* */
+#define TIMER_REG_INTERVAL 0x10 /* RW: until it fires, also the period */
+#define TIMER_REG_STATUS 0x18	/* R: TIMER_STATUS_*, W: clears the bits set */
+#define TIMER_REG_COUNT 0x20	/* R: times it fired */
+
+#define TIMER_CTRL_ENABLE (1u << 0)
+#define TIMER_CTRL_PERIODIC (1u << 1)
+#define TIMER_CTRL_HOST (1u << 2)
+#define TIMER_CTRL_IRQ (1u << 3)
+#define TIMER_STATUS_FIRED (1u << 0)
+
+#define ICR_TIMER 10 /* IRC0 */
+
+/* false with errno set if the registers can't be mapped */
+bool timer_init(void);
+
+/* after a restore, picks the saved deadline up again */
+void timer_restored(struct core *c);
+
+#endif // TIMER_H
@@ -0,0 +1,55 @@
+; ALU ops with FR as the destination. add/sub/mul leave exactly the result in
+; FR, logic ops the result with ZF/SF of it, later flag updates don't touch it.
+; runs in batch mode, the value of the one result is 0 or the failed check:
+;   printf '\0\0\0\0' | ./cpu -b fr_dest.bin | od -An -tx8
+    .define BATCH_BASE 0x90200000
+    .define BATCH_REG_DONE 0x90200008
+
+    .org 0x7FFF000
+_start:
+    mov r1, BATCH_BASE
+    str r1, r0
+    mov r11, fail
+
+    mov r9, 1
+    mov fr, 0
+    mov r2, 5
+    add fr, r2
+    mov r3, fr
+    cmp r3, 5
+    cmov ne, pc, r11
+
+    mov r9, 2
+    mov fr, 1
+    sub fr, 1
+    mov r3, fr
+    cmp r3, 0
+    cmov ne, pc, r11
+
+    mov r9, 3
+    mov fr, 3
+    mul fr, 3
+    mov r3, fr
+    cmp r3, 9
+    cmov ne, pc, r11
+
+    mov r9, 4
+    mov fr, 0
+    add fr, 1
+    add fr, 6
+    mov r3, fr
+    cmp r3, 7
+    cmov ne, pc, r11
+
+    mov r9, 5
+    mov fr, 7
+    xor fr, fr          ; ZF of the zero result
+    mov r3, fr
+    cmp r3, 2
+    cmov ne, pc, r11
+
+    mov r9, 0
+fail:
+    mov r1, BATCH_REG_DONE
+    str r1, r9
+    hlt